@@ -0,0 +1,109 @@
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Bitmap allocator: bit i lives in byte i / 8 at bit i % 8, the on-disk layout.
+ * Scans go a 64-bit word at a time, skip full words and locate the first zero
+ * with ctz. Buffers must be a whole number of 8-byte words long. */
+
+static inline uint64_t bitmap_word(const uint8_t *bmap, uint32_t w) {
+    uint64_t v;
+    memcpy(&v, bmap + (size_t)w * 8, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* First zero bit in [from, to), or -1 */
+static inline int64_t bitmap_scan(const uint8_t *bmap, uint32_t from, uint32_t to) {
+    if (from >= to) return -1;
+    uint32_t w = from / 64;
+    uint64_t free_bits = ~bitmap_word(bmap, w) & (~0ULL << (from % 64));
+    for (;;) {
+        if (free_bits) {
+            uint64_t bit = (uint64_t)w * 64 + __builtin_ctzll(free_bits);
+            return bit < to ? (int64_t)bit : -1;
+        }
+        if ((uint64_t)++w * 64 >= to) return -1;
+        free_bits = ~bitmap_word(bmap, w);
+    }
+}
+
+/* Length of the run of zero bits starting at from, stopping at to */
+static inline uint32_t bitmap_run(const uint8_t *bmap, uint32_t from, uint32_t to) {
+    if (from >= to) return 0;
+    uint32_t w = from / 64;
+    uint64_t used = bitmap_word(bmap, w) & (~0ULL << (from % 64));
+    while (!used) {
+        if ((uint64_t)++w * 64 >= to) return to - from;
+        used = bitmap_word(bmap, w);
+    }
+    uint64_t end = (uint64_t)w * 64 + __builtin_ctzll(used);
+    return (end < to ? end : to) - from;
+}
+
+static inline void bitmap_set(uint8_t *bmap, uint32_t idx) {
+    bmap[idx / 8] |= (1 << (idx % 8));
+}
+
+/* Sets bits [from, to), whole bytes at a time in the middle */
+static inline void bitmap_set_range(uint8_t *bmap, uint32_t from, uint32_t to) {
+    for (; from < to && from % 8; from++)
+        bitmap_set(bmap, from);
+    if (to - from >= 8) {
+        memset(bmap + from / 8, 0xFF, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    for (; from < to; from++)
+        bitmap_set(bmap, from);
+}
+
+/* Clears bits [from, to), whole bytes at a time in the middle */
+static inline void bitmap_clear_range(uint8_t *bmap, uint32_t from, uint32_t to) {
+    for (; from < to && from % 8; from++)
+        bmap[from / 8] &= ~(1 << (from % 8));
+    if (to - from >= 8) {
+        memset(bmap + from / 8, 0, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    for (; from < to; from++)
+        bmap[from / 8] &= ~(1 << (from % 8));
+}
+
+/* Block b of a multi-block bitmap, as the search should see it */
+typedef const uint8_t *(*bitmap_block_fn)(void *ctx, uint32_t b);
+
+/* Next-fit over a bitmap of nbits held in blocks of block_bits bits (a
+ * multiple of 64), read through get: finds the first zero bit at or after
+ * *hint, wrapping around once, and the run of up to want zero bits from
+ * there. Runs never span blocks, and the last block get() returned is the
+ * run's. Returns the first bit, sets *got to the run length and moves *hint
+ * past it, or returns -1 when every bit is set. The caller marks the run. */
+static inline int64_t bitmap_next_fit(uint32_t nbits, uint32_t block_bits, uint32_t want,
+                                      uint32_t *hint, uint32_t *got, bitmap_block_fn get,
+                                      void *ctx) {
+    uint32_t nblocks = (nbits + block_bits - 1) / block_bits;
+    uint32_t start = *hint < nbits ? *hint : 0;
+
+    for (uint32_t k = 0; k <= nblocks; k++) {
+        uint32_t b = (start / block_bits + k) % nblocks;
+        uint32_t base = b * block_bits;
+        uint32_t from = k == 0 ? start - base : 0;
+        uint32_t to = k == nblocks ? start - base
+                    : nbits - base < block_bits ? nbits - base : block_bits;
+        const uint8_t *bmap = get(ctx, b);
+        int64_t i = bitmap_scan(bmap, from, to);
+        if (i >= 0) {
+            uint32_t end = to - i > want ? i + want : to;
+            *got = bitmap_run(bmap, i, end);
+            *hint = base + i + *got;
+            return base + i;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef VSFS_CRC32C_H
+#define VSFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+/* CRC32C (Castagnoli, reflected polynomial 0x82F63B78), the checksum of
+ * iSCSI and ext4. Like zlib's crc32(), crc is the value so far: start from 0
+ * and feed buffers in order. Uses the SSE4.2 crc32 instruction when the CPU
+ * has it, else a byte-wise table. */
+
+static uint32_t crc32c_table[256];
+
+__attribute__((constructor)) static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+#if defined(__x86_64__)
+    uint64_t c = ~crc;
+    for (; len && ((uintptr_t)p & 7); len--)
+        c = _mm_crc32_u8(c, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+#else
+    uint32_t c = ~crc;
+    for (; len >= 4; len -= 4, p += 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u32(c, v);
+    }
+#endif
+    for (; len; len--)
+        c = _mm_crc32_u8(c, *p++);
+    return ~(uint32_t)c;
+}
+#endif
+
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+#ifdef CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_hw(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+#endif
@@ -1,328 +1,551 @@
-#include <fcntl.h>
+#define _GNU_SOURCE     /* accept4 */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-#define BLOCK_SIZE 4096
-#define INODE_SIZE 128
-#define DIRECT_POINTERS 8
-#define NAME_LEN 28
+#include "vsfs.h"
 
-#define FS_MAGIC 0x56534653
-#define JOURNAL_MAGIC 0x4A524E4C
+/* Command-line front end to libvsfs: cc -O2 -pthread -o vsfs project.c vsfs.c */
 
-#define REC_DATA 0xD0DA
-#define REC_COMMIT 0xC0DE
-
-#define JOURNAL_BLOCK_IDX 1
+/* Default geometry for mkfs; everything else reads the layout from the superblock */
 #define JOURNAL_BLOCKS 16
-#define INODE_BLOCKS 2
+#define INODE_COUNT 64
 #define DATA_BLOCKS 64
-#define INODE_BMAP_IDX (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX (INODE_BMAP_IDX + 1)
-#define INODE_START_IDX (DATA_BMAP_IDX + 1)
-#define DATA_START_IDX (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS (DATA_START_IDX + DATA_BLOCKS)
-
-struct superblock {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
-    uint32_t inode_count;
-    uint32_t journal_block;
-    uint32_t inode_bitmap;
-    uint32_t data_bitmap;
-    uint32_t inode_start;
-    uint32_t data_start;
-    uint8_t _pad[128 - 9*4];
-};
-
-struct inode {
-    uint16_t type;
-    uint16_t links;
-    uint32_t size;
-    uint32_t direct[DIRECT_POINTERS];
-    uint32_t ctime;
-    uint32_t mtime;
-    uint8_t _pad[128 - (2+2+4+8*4+4+4)];
-};
-
-struct dirent {
-    uint32_t inode;
-    char name[NAME_LEN];
-};
-
-struct journal_header {
-    uint32_t magic;
-    uint32_t nbytes_used;
-};
-
-struct rec_header {
-    uint16_t type;
-    uint16_t size;
-};
+#define DIR_INDEX_BLOCKS 1
 
-struct data_record {
-    struct rec_header hdr;
-    uint32_t block_no;
-    uint8_t data[BLOCK_SIZE];
-};
-
-struct commit_record {
-    struct rec_header hdr;
-};
-
-/* Helper functions */
 static void die(const char *msg) {
     perror(msg);
     exit(1);
 }
 
-static void read_block(int fd, uint32_t blk, void *buf) {
-    if (lseek(fd, blk * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (read(fd, buf, BLOCK_SIZE) != BLOCK_SIZE) die("read_block");
+/* Create command */
+/* Creates every file in one transaction, so shared blocks are logged once */
+static int cmd_create(struct fs *fs, const char *const *filenames, int n) {
+    if (fs_create(fs, filenames, n) < 0) return -1;
+
+    if (n == 1)
+        printf("Created journal entry for file '%s'\n", filenames[0]);
+    else
+        printf("Created journal entry for %d files\n", n);
+    return 0;
 }
 
-static void write_block(int fd, uint32_t blk, void *buf) {
-    if (lseek(fd, blk * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE) die("write_block");
+/* Creates each file in its own transaction; with group commit several of them
+ * share one journal write and flush */
+static int cmd_create_each(struct fs *fs, const char *const *filenames, int n) {
+    int rc = 0;
+    for (int i = 0; i < n; i++)
+        if (cmd_create(fs, &filenames[i], 1) < 0)
+            rc = -1;
+    return rc;
 }
 
-static int bitmap_find_free(uint8_t *bmap, int max) {
-    for (int i = 0; i < max; i++)
-        if (!(bmap[i/8] & (1 << (i%8))))
-            return i;
-    return -1;
+/* Creates each file in its own transaction from several threads, each with
+ * its own handle, taking names in order from a shared counter */
+struct create_worker {
+    struct fs *fs;
+    const char *const *filenames;
+    int n;
+    int *next;
+    int rc;
+};
+
+static void *create_worker(void *arg) {
+    struct create_worker *w = arg;
+    struct fs_handle *h = fs_handle_open(w->fs);
+    int i;
+    while ((i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < w->n) {
+        if (fs_handle_create(h, &w->filenames[i], 1) < 0)
+            w->rc = -1;
+        else
+            printf("Created journal entry for file '%s'\n", w->filenames[i]);
+    }
+    fs_handle_close(h);
+    return NULL;
 }
 
-static void bitmap_set(uint8_t *bmap, int idx) {
-    bmap[idx/8] |= (1 << (idx%8));
+static int cmd_create_parallel(struct fs *fs, const char *const *filenames, int n,
+                               int threads) {
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    struct create_worker *w = calloc(threads, sizeof(*w));
+    if (!tids || !w) die("calloc");
+    int next = 0, rc = 0;
+    for (int i = 0; i < threads; i++) {
+        w[i] = (struct create_worker){.fs = fs, .filenames = filenames, .n = n, .next = &next};
+        errno = pthread_create(&tids[i], NULL, create_worker, &w[i]);
+        if (errno) die("pthread_create");
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (w[i].rc < 0) rc = -1;
+    }
+    free(tids);
+    free(w);
+    return rc;
 }
 
-/* Journal Management Functions */
-static void init_journal_if_needed(int fd, struct superblock *sb) {
-    struct journal_header jh;
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (read(fd, &jh, sizeof(jh)) != sizeof(jh)) die("read");
-
-    if (jh.magic != JOURNAL_MAGIC) {
-        jh.magic = JOURNAL_MAGIC;
-        jh.nbytes_used = sizeof(jh);
-        if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-        if (write(fd, &jh, sizeof(jh)) != sizeof(jh)) die("write");
+/* Next filename, one per line with blank lines skipped; NULL at end of input.
+ * The result lives in *line until the next call. */
+static char *read_name(FILE *in, char **line, size_t *len) {
+    ssize_t r;
+    while ((r = getline(line, len, in)) >= 0) {
+        while (r > 0 && ((*line)[r - 1] == '\n' || (*line)[r - 1] == '\r'))
+            (*line)[--r] = '\0';
+        if (r > 0) return *line;
     }
+    return NULL;
 }
 
-static int append_to_journal(int fd, struct superblock *sb, void *record, size_t size) {
-    struct journal_header jh;
+static char **read_names(FILE *in, int *count) {
+    char **names = NULL;
+    int n = 0, cap = 0;
+    char *line = NULL, *name;
+    size_t len = 0;
+
+    while ((name = read_name(in, &line, &len))) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = realloc(names, cap * sizeof(*names));
+            if (!names) die("realloc");
+        }
+        names[n] = strdup(name);
+        if (!names[n]) die("strdup");
+        n++;
+    }
+    free(line);
+    *count = n;
+    return names;
+}
 
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (read(fd, &jh, sizeof(jh)) != sizeof(jh)) die("read");
+/* Creates each name as it arrives, so a long-running producer can feed it */
+static int cmd_create_stream(struct fs *fs, FILE *in) {
+    int rc = 0;
+    char *line = NULL;
+    const char *name;
+    size_t len = 0;
+    while ((name = read_name(in, &line, &len)))
+        if (cmd_create(fs, &name, 1) < 0)
+            rc = -1;
+    free(line);
+    return rc;
+}
 
-    if (jh.nbytes_used + size > JOURNAL_BLOCKS * BLOCK_SIZE) {
-        fprintf(stderr, "Journal full. Run 'install' first.\n");
-        return -1;
+/* Install command */
+/* Checkpoints the oldest max_txns committed transactions (all by default) */
+static int cmd_install(struct fs *fs, uint32_t max_txns) {
+    struct fs_stat st;
+    fs_stat(fs, &st);
+    if (st.pending == 0) {
+        printf("Journal is empty\n");
+        return 0;
     }
 
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE + jh.nbytes_used, SEEK_SET) < 0) die("lseek");
-    if (write(fd, record, size) != (ssize_t)size) die("write");
+    int64_t n = fs_install(fs, max_txns);
+    if (n < 0) return -1;
+    fs_stat(fs, &st);
+    printf("Applied %lld journaled transaction%s through TID %llu (%u still pending)\n",
+           (long long)n, n == 1 ? "" : "s", (unsigned long long)st.installed_tid, st.pending);
+    return 0;
+}
 
-    jh.nbytes_used += size;
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (write(fd, &jh, sizeof(jh)) != sizeof(jh)) die("write");
+/* Lookup command */
+static int cmd_lookup(struct fs *fs, const char *name) {
+    int64_t ino = fs_lookup(fs, name);
+    if (ino >= 0) printf("%s: inode %lld\n", name, (long long)ino);
+    else fprintf(stderr, "%s: not found\n", name);
+    return ino >= 0 ? 0 : -1;
+}
 
+/* Write command */
+static int cmd_write(struct fs *fs, const char *filename, FILE *src) {
+    uint64_t size;
+    int64_t n = fs_write(fs, filename, src, &size);
+    if (n < 0) return -1;
+    printf("Wrote %lld bytes to '%s' (now %llu bytes)\n", (long long)n, filename,
+           (unsigned long long)size);
     return 0;
 }
 
-static void read_superblock(int fd, struct superblock *sb) {
-    if (lseek(fd, 0, SEEK_SET) < 0) die("lseek");
-    if (read(fd, sb, sizeof(*sb)) != sizeof(*sb)) die("read");
+/* Serve command: one process keeps the image open and answers requests from
+ * local clients, one per line, with one line each in order:
+ *   create <name>     ok <inode>
+ *   install [count]   ok <applied> <pending>
+ *   stat              ok commits=<n> ...
+ * and "err <reason>" on failure. A client may pipeline any number of
+ * requests. Replies go out once each poll round's work is committed, so with
+ * --group-commit every create read in a round shares one flush. */
+#define SERVE_LINE_MAX 256
+
+struct client {
+    int fd;
+    char in[SERVE_LINE_MAX];
+    size_t in_len;
+    char *out;
+    size_t out_len, out_cap;
+};
 
-    if (sb->magic != FS_MAGIC) {
-        fprintf(stderr, "Invalid filesystem magic: 0x%08x\n", sb->magic);
-        exit(1);
-    }
+static volatile sig_atomic_t serve_stop;
+
+static void serve_on_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
 }
 
-/* Create command */
-static void cmd_create(int fd, struct superblock *sb, const char *filename) {
-    init_journal_if_needed(fd, sb);
-
-    uint8_t inode_bmap[BLOCK_SIZE];
-    uint8_t data_bmap[BLOCK_SIZE];
-    read_block(fd, sb->inode_bitmap, inode_bmap);
-    read_block(fd, sb->data_bitmap, data_bmap);
-
-    int new_ino = bitmap_find_free(inode_bmap, 64);
-    if (new_ino < 0) die("no free inode");
-
-    uint8_t new_inode_bmap[BLOCK_SIZE];
-    memcpy(new_inode_bmap, inode_bmap, BLOCK_SIZE);
-    bitmap_set(new_inode_bmap, new_ino);
-
-    uint8_t inode_block_buf[BLOCK_SIZE];
-    read_block(fd, sb->inode_start, inode_block_buf);
-    struct inode *root = (struct inode *)inode_block_buf;
-
-    uint8_t dir_block[BLOCK_SIZE];
-    read_block(fd, root->direct[0], dir_block);
-
-    struct inode new_inode = {0};
-    new_inode.type = 1;
-    new_inode.links = 1;
-    new_inode.size = 0;
-    new_inode.ctime = time(NULL);
-    new_inode.mtime = time(NULL);
-
-    uint32_t inode_block_num = sb->inode_start + (new_ino / 32);
-    uint32_t inode_offset = (new_ino % 32) * INODE_SIZE;
-
-    uint8_t new_inode_block[BLOCK_SIZE];
-    read_block(fd, inode_block_num, new_inode_block);
-    memcpy(new_inode_block + inode_offset, &new_inode, sizeof(new_inode));
-
-    uint8_t new_dir_block[BLOCK_SIZE];
-    memcpy(new_dir_block, dir_block, BLOCK_SIZE);
-
-    struct dirent *de = (struct dirent *)new_dir_block;
-    int entries = root->size / sizeof(struct dirent);
-
-    de[entries].inode = new_ino;
-    strncpy(de[entries].name, filename, NAME_LEN - 1);
-    de[entries].name[NAME_LEN - 1] = '\0';
-
-    uint8_t new_root_inode_block[BLOCK_SIZE];
-    memcpy(new_root_inode_block, inode_block_buf, BLOCK_SIZE);
-    struct inode *new_root = (struct inode *)new_root_inode_block;
-    new_root->size += sizeof(struct dirent);
-    new_root->mtime = time(NULL);
-
-    struct data_record dr1 = {
-        .hdr = {.type = REC_DATA, .size = sizeof(struct data_record)},
-        .block_no = sb->inode_bitmap
-    };
-    memcpy(dr1.data, new_inode_bmap, BLOCK_SIZE);
-    if (append_to_journal(fd, sb, &dr1, sizeof(dr1)) < 0) return;
-
-    struct data_record dr2 = {
-        .hdr = {.type = REC_DATA, .size = sizeof(struct data_record)},
-        .block_no = inode_block_num
-    };
-    memcpy(dr2.data, new_inode_block, BLOCK_SIZE);
-    if (append_to_journal(fd, sb, &dr2, sizeof(dr2)) < 0) return;
-
-    struct data_record dr3 = {
-        .hdr = {.type = REC_DATA, .size = sizeof(struct data_record)},
-        .block_no = root->direct[0]
-    };
-    memcpy(dr3.data, new_dir_block, BLOCK_SIZE);
-    if (append_to_journal(fd, sb, &dr3, sizeof(dr3)) < 0) return;
-
-    struct data_record dr4 = {
-        .hdr = {.type = REC_DATA, .size = sizeof(struct data_record)},
-        .block_no = sb->inode_start
-    };
-    memcpy(dr4.data, new_root_inode_block, BLOCK_SIZE);
-    if (append_to_journal(fd, sb, &dr4, sizeof(dr4)) < 0) return;
-
-    struct commit_record cr = {
-        .hdr = {.type = REC_COMMIT, .size = sizeof(struct commit_record)}
-    };
-    if (append_to_journal(fd, sb, &cr, sizeof(cr)) < 0) return;
-
-    printf("Created journal entry for file '%s'\n", filename);
+static void client_reply(struct client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void client_reply(struct client *c, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(c->out + c->out_len, c->out_cap - c->out_len, fmt, ap);
+        va_end(ap);
+        if (n < 0) die("vsnprintf");
+        if (c->out_len + n < c->out_cap) {
+            c->out_len += n;
+            return;
+        }
+        c->out_cap = (c->out_len + n + 1) * 2;
+        c->out = realloc(c->out, c->out_cap);
+        if (!c->out) die("realloc");
+    }
 }
 
-/* Install command */
-static void cmd_install(int fd, struct superblock *sb) {
-    struct journal_header jh;
+static void serve_request(struct fs *fs, struct client *c, char *line) {
+    char *arg = strchr(line, ' ');
+    if (arg) *arg++ = '\0';
 
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (read(fd, &jh, sizeof(jh)) != sizeof(jh)) die("read");
+    if (strcmp(line, "create") == 0 && arg && *arg) {
+        if (strlen(arg) > FS_NAME_MAX) {
+            client_reply(c, "err name longer than %d bytes\n", FS_NAME_MAX);
+            return;
+        }
+        const char *name = arg;
+        int64_t ino = fs_create(fs, &name, 1);
+        if (ino < 0) client_reply(c, "err cannot create '%s'\n", arg);
+        else client_reply(c, "ok %lld\n", (long long)ino);
+    } else if (strcmp(line, "install") == 0) {
+        int64_t n = fs_install(fs, arg ? strtoul(arg, NULL, 0) : UINT32_MAX);
+        struct fs_stat st;
+        fs_stat(fs, &st);
+        if (n < 0) client_reply(c, "err cannot install\n");
+        else client_reply(c, "ok %lld %u\n", (long long)n, st.pending);
+    } else if (strcmp(line, "stat") == 0) {
+        struct fs_stat st;
+        fs_stat(fs, &st);
+        client_reply(c, "ok commits=%llu pending=%u installed_tid=%llu next_tid=%llu "
+                     "journal_used=%llu journal_size=%u cache_hits=%llu cache_misses=%llu\n",
+                     (unsigned long long)st.commits, st.pending,
+                     (unsigned long long)st.installed_tid, (unsigned long long)st.next_tid,
+                     (unsigned long long)st.journal_used, st.journal_size,
+                     (unsigned long long)st.cache_hits, (unsigned long long)st.cache_misses);
+    } else {
+        client_reply(c, "err unknown request\n");
+    }
+}
 
-    if (jh.magic != JOURNAL_MAGIC) {
-        fprintf(stderr, "Journal not initialized or corrupted\n");
-        exit(1);
+/* Runs every complete line in the input buffer. Returns -1 for a line too
+ * long to ever complete, which drops the client. */
+static int serve_input(struct fs *fs, struct client *c) {
+    size_t done = 0;
+    char *nl;
+    while ((nl = memchr(c->in + done, '\n', c->in_len - done))) {
+        *nl = '\0';
+        char *line = c->in + done;
+        if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+        if (*line) serve_request(fs, c, line);
+        done = nl + 1 - c->in;
     }
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done;
+    return c->in_len == sizeof(c->in) ? -1 : 0;
+}
 
-    if (jh.nbytes_used == sizeof(jh)) {
-        printf("Journal is empty\n");
-        return;
+/* Writes what the socket takes now; the rest waits for POLLOUT */
+static int client_flush(struct client *c) {
+    size_t off = 0;
+    while (off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + off, c->out_len - off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
     }
+    memmove(c->out, c->out + off, c->out_len - off);
+    c->out_len -= off;
+    return 0;
+}
 
-    uint32_t pos = sizeof(jh);
-    int in_transaction = 0;
+static int cmd_serve(struct fs *fs, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0) die("socket");
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) die("bind");
+    if (listen(lfd, SOMAXCONN) < 0) die("listen");
+
+    /* Stop cleanly on SIGINT/SIGTERM so the last group reaches the disk */
+    struct sigaction sa = {.sa_handler = serve_on_signal};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fs_start_checkpointer(fs);
+    fprintf(stderr, "Serving %s\n", path);
+
+    struct client *clients = NULL;
+    struct pollfd *pfd = NULL;
+    int nclients = 0, cap = 0, rc = 0;
+
+    while (!serve_stop) {
+        if (cap < nclients + 1) {
+            cap = cap ? cap * 2 : 16;
+            clients = realloc(clients, cap * sizeof(*clients));
+            pfd = realloc(pfd, (cap + 1) * sizeof(*pfd));
+            if (!clients || !pfd) die("realloc");
+        }
+        pfd[0] = (struct pollfd){.fd = lfd, .events = POLLIN};
+        for (int i = 0; i < nclients; i++)
+            pfd[i + 1] = (struct pollfd){
+                .fd = clients[i].fd, .events = clients[i].out_len ? POLLOUT : POLLIN
+            };
+        if (poll(pfd, nclients + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
 
-    while (pos < jh.nbytes_used) {
-        struct rec_header rh;
-        if (lseek(fd, sb->journal_block * BLOCK_SIZE + pos, SEEK_SET) < 0) die("lseek");
-        if (read(fd, &rh, sizeof(rh)) != sizeof(rh)) die("read");
+        for (int i = 0; i < nclients; i++) {
+            struct client *c = &clients[i];
+            if (!(pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) || c->out_len)
+                continue;
+            ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0 || (c->in_len += n, serve_input(fs, c) < 0)) {
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
 
-        if (rh.type == REC_DATA) {
-            struct data_record dr;
-            if (lseek(fd, sb->journal_block * BLOCK_SIZE + pos, SEEK_SET) < 0) die("lseek");
-            if (read(fd, &dr, sizeof(dr)) != sizeof(dr)) die("read");
+        /* Replies promise durability only once the round's group is flushed;
+         * if it cannot be, none go out */
+        if (fs_sync(fs) < 0) {
+            rc = -1;
+            break;
+        }
 
-            if (in_transaction) {
-                write_block(fd, dr.block_no, dr.data);
+        int kept = 0;
+        for (int i = 0; i < nclients; i++) {
+            struct client *c = &clients[i];
+            if (c->fd >= 0 && client_flush(c) < 0) {
+                close(c->fd);
+                c->fd = -1;
             }
+            if (c->fd < 0) {
+                free(c->out);
+                continue;
+            }
+            clients[kept++] = *c;
+        }
+        nclients = kept;
 
-            pos += rh.size;
-        } else if (rh.type == REC_COMMIT) {
-            in_transaction = 1;
-            struct commit_record cr;
-            if (lseek(fd, sb->journal_block * BLOCK_SIZE + pos, SEEK_SET) < 0) die("lseek");
-            if (read(fd, &cr, sizeof(cr)) != sizeof(cr)) die("read");
-
-            pos += rh.size;
-            in_transaction = 0;
-        } else {
-            fprintf(stderr, "Unknown record type: 0x%04x\n", rh.type);
-            break;
+        if (pfd[0].revents & POLLIN) {
+            int fd;
+            while (nclients < cap && (fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                clients[nclients++] = (struct client){.fd = fd};
         }
     }
 
-    jh.nbytes_used = sizeof(jh);
-    if (lseek(fd, sb->journal_block * BLOCK_SIZE, SEEK_SET) < 0) die("lseek");
-    if (write(fd, &jh, sizeof(jh)) != sizeof(jh)) die("write");
-
-    printf("Applied journaled changes\n");
+    for (int i = 0; i < nclients; i++) {
+        close(clients[i].fd);
+        free(clients[i].out);
+    }
+    free(clients);
+    free(pfd);
+    close(lfd);
+    unlink(path);
+    return rc;
 }
 
 /* Main */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <img> <command> [args]\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --cache=<blocks>   - Block cache size (default %d)\n", FS_CACHE_BLOCKS_DEFAULT);
+    fprintf(stderr, "  --stats            - Print cache statistics on exit\n");
+    fprintf(stderr, "  --mmap             - Map the image and msync at commit points\n");
+    fprintf(stderr, "  --direct           - Write the journal with O_DIRECT, bypassing the page cache\n");
+    fprintf(stderr, "  --io-uring         - Batch block I/O through io_uring (built with\n");
+    fprintf(stderr, "                       -DHAVE_LIBURING -luring)\n");
+    fprintf(stderr, "  --sync             - Make every commit durable before returning\n");
+    fprintf(stderr, "  --group-commit=<n> - Durable, flushing up to n transactions together\n");
+    fprintf(stderr, "  --group-latency=<ms>\n");
+    fprintf(stderr, "                     - Durable, flushing a group once its oldest is ms old\n");
+    fprintf(stderr, "  --install-threads=<n>\n");
+    fprintf(stderr, "                     - Parallel writers when checkpointing (default %d)\n",
+            FS_INSTALL_THREADS);
+    fprintf(stderr, "  --threads=<n>      - Run create from n threads (names from stdin are\n");
+    fprintf(stderr, "                       read up front)\n");
+    fprintf(stderr, "  --checkpoint-at=<pct>\n");
+    fprintf(stderr, "                     - Checkpoint from a background thread once the journal\n");
+    fprintf(stderr, "                       is pct%% full, while creates keep committing\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  mkfs [--journal-blocks=<n>] [--inodes=<n>] [--data-blocks=<n>] [--dir-index=<n>]\n");
+    fprintf(stderr, "                     - Create an empty filesystem (defaults %d, %d, %d, %d;\n",
+            JOURNAL_BLOCKS, INODE_COUNT, DATA_BLOCKS, DIR_INDEX_BLOCKS);
+    fprintf(stderr, "                       a 0-block index gives a linear root directory)\n");
+    fprintf(stderr, "  create <filename...>\n");
+    fprintf(stderr, "                     - Journal new files, one transaction each\n");
+    fprintf(stderr, "                       (names are read from stdin for '-')\n");
+    fprintf(stderr, "  create-batch [filename...]\n");
+    fprintf(stderr, "                     - Journal many creations as one transaction\n");
+    fprintf(stderr, "                       (names are read from stdin when none are given)\n");
+    fprintf(stderr, "  install [count]    - Apply the oldest count journaled transactions (default all)\n");
+    fprintf(stderr, "  write <filename> [src]\n");
+    fprintf(stderr, "                     - Append src (default stdin) to a file, creating it\n");
+    fprintf(stderr, "  read <filename>    - Copy a file to stdout\n");
+    fprintf(stderr, "  lookup <filename>  - Print the inode of a file in the root directory\n");
+    fprintf(stderr, "  serve <socket>     - Keep the image open and answer create, install and\n");
+    fprintf(stderr, "                       stat requests on a Unix socket until SIGTERM\n");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <img> <command> [args]\n", argv[0]);
-        fprintf(stderr, "Commands:\n");
-        fprintf(stderr, "  create <filename>  - Journal a new file creation\n");
-        fprintf(stderr, "  install            - Apply journaled changes\n");
-        return 1;
+    struct fs_opts opts = FS_OPTS_DEFAULT;
+    int threads = 1;
+
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        if (strncmp(argv[argi], "--cache=", 8) == 0) {
+            opts.cache_blocks = strtoul(argv[argi] + 8, NULL, 0);
+        } else if (strcmp(argv[argi], "--stats") == 0) {
+            opts.stats = 1;
+        } else if (strcmp(argv[argi], "--mmap") == 0) {
+            opts.use_mmap = 1;
+        } else if (strcmp(argv[argi], "--direct") == 0) {
+            opts.direct = 1;
+        } else if (strcmp(argv[argi], "--io-uring") == 0) {
+            opts.use_uring = 1;
+        } else if (strcmp(argv[argi], "--sync") == 0) {
+            if (!opts.group_max) opts.group_max = 1;
+        } else if (strncmp(argv[argi], "--group-commit=", 15) == 0) {
+            opts.group_max = strtoul(argv[argi] + 15, NULL, 0);
+            if (!opts.group_max) opts.group_max = 1;
+        } else if (strncmp(argv[argi], "--install-threads=", 18) == 0) {
+            opts.install_threads = strtoul(argv[argi] + 18, NULL, 0);
+        } else if (strncmp(argv[argi], "--threads=", 10) == 0) {
+            threads = strtoul(argv[argi] + 10, NULL, 0);
+            if (threads < 1) threads = 1;
+        } else if (strncmp(argv[argi], "--checkpoint-at=", 16) == 0) {
+            opts.checkpoint_at = strtoul(argv[argi] + 16, NULL, 0);
+            if (opts.checkpoint_at > 100) opts.checkpoint_at = 100;
+        } else if (strncmp(argv[argi], "--group-latency=", 16) == 0) {
+            opts.group_latency_ms = strtoul(argv[argi] + 16, NULL, 0);
+            if (!opts.group_max) opts.group_max = UINT32_MAX;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    int fd = open(argv[1], O_RDWR);
-    if (fd < 0) die("open");
+    if (argc - argi < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *img = argv[argi];
+    const char *cmd = argv[argi + 1];
+    char **args = argv + argi + 2;
+    int nargs = argc - argi - 2;
+
+    if (strcmp(cmd, "mkfs") == 0) {
+        uint32_t journal_blocks = JOURNAL_BLOCKS, inodes = INODE_COUNT, data_blocks = DATA_BLOCKS;
+        uint32_t index_blocks = DIR_INDEX_BLOCKS;
+        for (int i = 0; i < nargs; i++) {
+            if (strncmp(args[i], "--journal-blocks=", 17) == 0) {
+                journal_blocks = strtoul(args[i] + 17, NULL, 0);
+            } else if (strncmp(args[i], "--inodes=", 9) == 0) {
+                inodes = strtoul(args[i] + 9, NULL, 0);
+            } else if (strncmp(args[i], "--data-blocks=", 14) == 0) {
+                data_blocks = strtoul(args[i] + 14, NULL, 0);
+            } else if (strncmp(args[i], "--dir-index=", 12) == 0) {
+                index_blocks = strtoul(args[i] + 12, NULL, 0);
+            } else {
+                fprintf(stderr, "Unknown mkfs option: %s\n", args[i]);
+                return 1;
+            }
+        }
+        int64_t total = fs_mkfs(img, journal_blocks, inodes, data_blocks, index_blocks);
+        if (total < 0) return 1;
+        printf("Created filesystem: %lld blocks, %u-block journal, %u inodes, %u data blocks\n",
+               (long long)total, journal_blocks, inodes, data_blocks);
+        return 0;
+    }
 
-    struct superblock sb;
-    read_superblock(fd, &sb);
+    struct fs *fs = fs_open(img, &opts);
+    if (!fs) return 1;
+    int rc = 0;
 
-    if (strcmp(argv[2], "create") == 0) {
-        if (argc < 4) {
-            fprintf(stderr, "Usage: %s <img> create <filename>\n", argv[0]);
-            close(fd);
+    if (strcmp(cmd, "create") == 0 || strcmp(cmd, "create-batch") == 0) {
+        int batch = strcmp(cmd, "create-batch") == 0;
+        if (!batch && nargs < 1) {
+            fprintf(stderr, "Usage: %s <img> create <filename...|->\n", argv[0]);
+            fs_close(fs);
             return 1;
         }
-        cmd_create(fd, &sb, argv[3]);
-    } else if (strcmp(argv[2], "install") == 0) {
-        cmd_install(fd, &sb);
+        fs_start_checkpointer(fs);
+        int from_stdin = nargs == 0 || (nargs == 1 && strcmp(args[0], "-") == 0);
+        if (from_stdin && !batch && threads == 1) {
+            rc = cmd_create_stream(fs, stdin);
+        } else {
+            char **names = args;
+            int n = nargs;
+            if (from_stdin)
+                names = read_names(stdin, &n);
+            const char *const *list = (const char *const *)names;
+            if (n > 0 && batch)
+                rc = cmd_create(fs, list, n);
+            else if (n > 0)
+                rc = threads > 1 ? cmd_create_parallel(fs, list, n, threads)
+                                 : cmd_create_each(fs, list, n);
+            if (names != args) {
+                for (int i = 0; i < n; i++) free(names[i]);
+                free(names);
+            }
+        }
+    } else if (strcmp(cmd, "install") == 0) {
+        rc = cmd_install(fs, nargs > 0 ? strtoul(args[0], NULL, 0) : UINT32_MAX);
+    } else if (strcmp(cmd, "write") == 0 && (nargs == 1 || nargs == 2)) {
+        FILE *src = nargs == 1 || strcmp(args[1], "-") == 0 ? stdin : fopen(args[1], "rb");
+        if (!src) die(args[1]);
+        rc = cmd_write(fs, args[0], src);
+        if (src != stdin) fclose(src);
+    } else if (strcmp(cmd, "read") == 0 && nargs == 1) {
+        rc = fs_read(fs, args[0], stdout);
+    } else if (strcmp(cmd, "lookup") == 0 && nargs == 1) {
+        rc = cmd_lookup(fs, args[0]);
+    } else if (strcmp(cmd, "serve") == 0 && nargs == 1) {
+        rc = cmd_serve(fs, args[0]);
     } else {
-        fprintf(stderr, "Unknown command: %s\n", argv[2]);
-        close(fd);
+        fprintf(stderr, "Unknown command: %s\n", cmd);
+        fs_close(fs);
         return 1;
     }
 
-    close(fd);
-    return 0;
+    if (fs_close(fs) < 0) rc = -1;
+    return rc < 0 ? 1 : 0;
 }
@@ -0,0 +1,3093 @@
+#define _GNU_SOURCE     /* O_DIRECT */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "crc32c.h"
+#include "vsfs.h"
+
+/* io_uring backend, opt in with -DHAVE_LIBURING and link with -luring */
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#undef BLOCK_SIZE   /* from <linux/fs.h>; ours follows */
+#endif
+
+#define BLOCK_SIZE 4096
+#define INODE_SIZE 128
+#define DIRECT_POINTERS 8
+#define NAME_LEN (FS_NAME_MAX + 1)
+
+#define FS_MAGIC 0x56534653
+#define JOURNAL_MAGIC_V1 0x4A524E4C
+#define JOURNAL_MAGIC_V2 0x4A524E32   /* ring without commit checksums */
+#define JOURNAL_MAGIC_V3 0x4A524E33   /* checksums but no transaction IDs */
+#define JOURNAL_MAGIC 0x4A524E34
+#define JOURNAL_BLOCKS_MAX (UINT32_MAX / BLOCK_SIZE)   /* ring bytes must fit in 32 bits */
+
+#define REC_DATA 0xD0DA
+#define REC_DELTA 0xD017
+#define REC_COMMIT 0xC0DE
+#define REC_BEGIN 0xB091
+
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+#define INODE_TYPE_FILE 1
+#define INODE_TYPE_DIR 2
+
+/* Regions are laid out in this order, so each one's size is the distance to
+ * the next: journal, inode bitmap, data bitmap, inode table, data blocks */
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+    uint8_t _pad[128 - 9*4];
+};
+
+/* Regular files map their data with extents: a run of len blocks at logical
+ * block lblk lives at pblk. Up to INODE_EXTENTS sit in the inode itself; past
+ * that the inode holds index entries (len unused), each naming a leaf block of
+ * extents that starts at lblk. */
+#define EXT_MAGIC 0xF30A
+
+struct extent_header {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;     /* 0: entries are extents, 1: they point at leaf blocks */
+};
+
+struct extent {
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+};
+
+#define INODE_EXTENTS 5
+#define LEAF_EXTENTS ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+struct inode {
+    uint16_t type;
+    uint16_t links;
+    uint32_t size;
+    uint32_t direct[DIRECT_POINTERS];   /* directories only */
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t flags;
+    struct extent_header eh;
+    struct extent ext[INODE_EXTENTS];
+    uint8_t _pad[128 - (2+2+4+8*4+4+4+4+8+INODE_EXTENTS*12)];
+};
+
+#define INODE_FLAG_HASHED 0x1   /* directory with a hash index, see struct dx_root */
+#define INODE_FLAG_EXTENTS 0x2  /* data mapped by eh/ext */
+
+struct dirent {
+    uint32_t inode;
+    char name[NAME_LEN];
+};
+
+/* Hashed directories: direct[0] .. direct[index_blocks - 1] hold one bucket per
+ * hash value, the first block after this header. A leaf block of dirents
+ * serves a run of consecutive buckets that all point to it, and splits in
+ * half when it fills; a leaf down to one bucket grows a chain instead. */
+#define DX_MAGIC 0x44584958
+#define DX_LEAF_MAGIC 0x44584C46
+
+struct dx_root {
+    uint32_t magic;
+    uint32_t index_blocks;
+    uint32_t _pad[2];
+    uint32_t bucket[];
+};
+
+struct dx_leaf {
+    uint32_t magic;
+    uint32_t next;
+    uint32_t count;
+    uint8_t _pad[sizeof(struct dirent) - 12];
+    struct dirent de[];
+};
+
+#define DX_ROOT_BUCKETS ((BLOCK_SIZE - sizeof(struct dx_root)) / sizeof(uint32_t))
+#define DX_BUCKETS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirent))
+#define DX_LEAF_ENTRIES ((BLOCK_SIZE - sizeof(struct dx_leaf)) / sizeof(struct dirent))
+
+/* The journal's first block holds only this header; the remaining blocks are
+ * a ring of records addressed by 64-bit log sequence numbers (byte offsets
+ * that only grow). [head, tail) is live: head is the oldest transaction not
+ * yet checkpointed, tail is where the next record goes. installed_tid is the
+ * TID of the last checkpointed transaction, so the one at head is
+ * installed_tid + 1. */
+struct journal_header {
+    uint32_t magic;
+    uint32_t _pad;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t installed_tid;
+};
+
+struct rec_header {
+    uint16_t type;
+    uint16_t size;
+};
+
+struct data_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint8_t data[BLOCK_SIZE];
+};
+
+/* Byte-range update of one block: length bytes of data land at offset */
+struct delta_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;
+    uint8_t data[];
+};
+
+/* Opens every transaction; TIDs increase by one per commit */
+struct begin_record {
+    struct rec_header hdr;
+    uint32_t _pad;
+    uint64_t tid;
+};
+
+/* crc is CRC32C over the transaction's start LSN, its records and this
+ * record up to crc, so a torn transaction, or a stale one left by an
+ * earlier lap of the ring, fails to verify */
+struct commit_record {
+    struct rec_header hdr;
+    uint32_t crc;
+    uint64_t tid;
+};
+
+/* Helper functions */
+/* Only for running out of memory; I/O errors are returned through the fs_* calls */
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Block device: positional I/O on the image, one syscall per access,
+ * or plain memory accesses when the image is mapped. With an io_uring,
+ * bdev_submit() queues a whole batch of accesses with one syscall. */
+#define URING_DEPTH 64
+
+struct blkdev {
+    int fd;
+    uint8_t *map;       /* whole image when opened with use_mmap, else NULL */
+    size_t map_len;
+    uint64_t flushes;   /* fdatasync/msync calls, for --stats */
+    int dfd;            /* O_DIRECT descriptor for journal writes, or -1 */
+    int err;            /* errno of the first failed access, 0 while none has */
+#ifdef HAVE_LIBURING
+    int uring;
+    struct io_uring ring;
+    pthread_mutex_t ring_lock;  /* the checkpointer thread submits too */
+#endif
+};
+
+static int bdev_open(struct blkdev *dev, const char *path, int use_mmap, int use_uring) {
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    dev->map = NULL;
+    dev->map_len = 0;
+    dev->flushes = 0;
+    dev->dfd = -1;
+    dev->err = 0;
+
+#ifdef HAVE_LIBURING
+    dev->uring = 0;
+    if (use_uring && !use_mmap) {
+        int err = io_uring_queue_init(URING_DEPTH, &dev->ring, 0);
+        if (err < 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using pread/pwrite\n", strerror(-err));
+        } else {
+            dev->uring = 1;
+            pthread_mutex_init(&dev->ring_lock, NULL);
+        }
+    }
+#else
+    if (use_uring)
+        fprintf(stderr, "Built without liburing, using pread/pwrite\n");
+#endif
+
+    if (use_mmap) {
+        struct stat st;
+        void *p = MAP_FAILED;
+        if (fstat(dev->fd, &st) == 0)
+            p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            close(dev->fd);
+            return -1;
+        }
+        dev->map = p;
+        dev->map_len = st.st_size;
+    }
+    return 0;
+}
+
+/* Records err as the device's first error. From then on writes are dropped
+ * and reads return zeroes, so nothing read after the failure reaches the
+ * image; the fs_* calls see it and fail. Returns -1. */
+static int bdev_error(struct blkdev *dev, int err) {
+    int none = 0;
+    __atomic_compare_exchange_n(&dev->err, &none, err, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return -1;
+}
+
+static int bdev_failed(struct blkdev *dev) {
+    return __atomic_load_n(&dev->err, __ATOMIC_SEQ_CST);
+}
+
+/* Reports and records a failed or short transfer of len bytes */
+static int bdev_check(struct blkdev *dev, ssize_t got, size_t len, const char *what) {
+    if (got == (ssize_t)len) return 0;
+    if (got < 0) {
+        int err = errno;
+        perror(what);
+        return bdev_error(dev, err);
+    }
+    fprintf(stderr, "%s: short transfer of %zd of %zu bytes\n", what, got, len);
+    return bdev_error(dev, EIO);
+}
+
+/* Pointer to len bytes at off inside the mapping, or NULL past its end; only
+ * valid in mmap mode */
+static uint8_t *bdev_ptr(struct blkdev *dev, off_t off, size_t len) {
+    if (off < 0 || (size_t)off + len > dev->map_len) {
+        fprintf(stderr, "Access beyond end of image at offset %lld\n", (long long)off);
+        bdev_error(dev, EIO);
+        return NULL;
+    }
+    return dev->map + off;
+}
+
+static void bdev_pread(struct blkdev *dev, off_t off, void *buf, size_t len) {
+    if (!bdev_failed(dev)) {
+        if (!dev->map) {
+            if (bdev_check(dev, pread(dev->fd, buf, len, off), len, "pread") == 0) return;
+        } else {
+            uint8_t *p = bdev_ptr(dev, off, len);
+            if (p) {
+                memcpy(buf, p, len);
+                return;
+            }
+        }
+    }
+    memset(buf, 0, len);
+}
+
+static void bdev_pwrite(struct blkdev *dev, off_t off, const void *buf, size_t len) {
+    if (bdev_failed(dev)) return;
+    if (dev->map) {
+        uint8_t *p = bdev_ptr(dev, off, len);
+        if (p) memcpy(p, buf, len);
+        return;
+    }
+    bdev_check(dev, pwrite(dev->fd, buf, len, off), len, "pwrite");
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Gathered write of n buffers at off */
+static void bdev_pwritev(struct blkdev *dev, off_t off, const struct iovec *iov, int n) {
+    if (dev->map) {
+        for (int i = 0; i < n; i++) {
+            bdev_pwrite(dev, off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+        return;
+    }
+    while (n > 0 && !bdev_failed(dev)) {
+        int batch = n < IOV_MAX ? n : IOV_MAX;
+        size_t want = 0;
+        for (int i = 0; i < batch; i++)
+            want += iov[i].iov_len;
+        bdev_check(dev, pwritev(dev->fd, iov, batch, off), want, "pwritev");
+        off += want;
+        iov += batch;
+        n -= batch;
+    }
+}
+
+/* One access of a batch: len bytes at off to or from buf, or for a write
+ * gathered from niov iovecs when iov is set */
+struct bio {
+    off_t off;
+    void *buf;
+    size_t len;
+    const struct iovec *iov;
+    int niov;
+};
+
+#ifdef HAVE_LIBURING
+/* Submits everything queued and checks that each access moved its full
+ * length. Once it fails the ring is never submitted again: what is left on
+ * it may point at buffers that are gone. */
+static void uring_complete(struct blkdev *dev, unsigned queued) {
+    int err = io_uring_submit_and_wait(&dev->ring, queued);
+    if (err < 0) {
+        errno = -err;
+        bdev_check(dev, -1, 0, "io_uring_submit");
+        return;
+    }
+    for (unsigned i = 0; i < queued; i++) {
+        struct io_uring_cqe *cqe = NULL;
+        err = io_uring_wait_cqe(&dev->ring, &cqe);
+        if (err < 0) {
+            errno = -err;
+            bdev_check(dev, -1, 0, "io_uring_wait_cqe");
+            return;
+        }
+        size_t want = (uintptr_t)io_uring_cqe_get_data(cqe);
+        if (cqe->res < 0) errno = -cqe->res;
+        if (cqe->res != -ECANCELED)     /* links after a failed access are cancelled */
+            bdev_check(dev, cqe->res < 0 ? -1 : cqe->res, want, "io_uring");
+        io_uring_cqe_seen(&dev->ring, cqe);
+    }
+}
+
+static void uring_submit(struct blkdev *dev, int write, const struct bio *b, int n, int linked) {
+    pthread_mutex_lock(&dev->ring_lock);
+    unsigned queued = 0;
+    struct io_uring_sqe *sqe = NULL;
+
+    for (int i = 0; i < n && !bdev_failed(dev); i++) {
+        const struct iovec *iov = b[i].iov;
+        int niov = b[i].niov;
+        off_t off = b[i].off;
+        do {
+            if (queued == URING_DEPTH) {
+                sqe->flags &= ~IOSQE_IO_LINK;   /* the wait below keeps the order */
+                uring_complete(dev, queued);
+                queued = 0;
+                if (bdev_failed(dev)) break;
+            }
+            sqe = io_uring_get_sqe(&dev->ring);
+            size_t len;
+            if (iov) {
+                int k = niov < IOV_MAX ? niov : IOV_MAX;
+                len = 0;
+                for (int j = 0; j < k; j++)
+                    len += iov[j].iov_len;
+                io_uring_prep_writev(sqe, dev->fd, iov, k, off);
+                iov += k;
+                niov -= k;
+                off += len;
+            } else {
+                len = b[i].len;
+                if (write)
+                    io_uring_prep_write(sqe, dev->fd, b[i].buf, len, off);
+                else
+                    io_uring_prep_read(sqe, dev->fd, b[i].buf, len, off);
+            }
+            io_uring_sqe_set_data(sqe, (void *)(uintptr_t)len);
+            if (linked) io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            queued++;
+        } while (niov > 0);
+    }
+    if (queued) {
+        sqe->flags &= ~IOSQE_IO_LINK;
+        uring_complete(dev, queued);
+    }
+    if (!write && bdev_failed(dev))
+        for (int i = 0; i < n; i++) memset(b[i].buf, 0, b[i].len);
+    pthread_mutex_unlock(&dev->ring_lock);
+}
+#endif
+
+/* Performs n reads or writes, returning once all are done. With linked set
+ * they must complete in order (io_uring links them; sequential anyway). */
+static void bdev_submit(struct blkdev *dev, int write, const struct bio *b, int n, int linked) {
+#ifdef HAVE_LIBURING
+    if (dev->uring) {
+        uring_submit(dev, write, b, n, linked);
+        return;
+    }
+#endif
+    (void)linked;
+    for (int i = 0; i < n; i++) {
+        if (b[i].iov)
+            bdev_pwritev(dev, b[i].off, b[i].iov, b[i].niov);
+        else if (write)
+            bdev_pwrite(dev, b[i].off, b[i].buf, b[i].len);
+        else
+            bdev_pread(dev, b[i].off, b[i].buf, b[i].len);
+    }
+}
+
+/* A second descriptor that bypasses the page cache; buffers, offsets and
+ * lengths used with it must be block aligned */
+static int bdev_open_direct(struct blkdev *dev, const char *path) {
+    dev->dfd = open(path, O_RDWR | O_DIRECT);
+    return dev->dfd < 0 ? -1 : 0;
+}
+
+static void bdev_pwrite_direct(struct blkdev *dev, off_t off, const void *buf, size_t len) {
+    if (!bdev_failed(dev))
+        bdev_check(dev, pwrite(dev->dfd, buf, len, off), len, "pwrite (O_DIRECT)");
+}
+
+static void bdev_read(struct blkdev *dev, uint32_t blk, void *buf) {
+    bdev_pread(dev, (off_t)blk * BLOCK_SIZE, buf, BLOCK_SIZE);
+}
+
+static void bdev_write(struct blkdev *dev, uint32_t blk, const void *buf) {
+    bdev_pwrite(dev, (off_t)blk * BLOCK_SIZE, buf, BLOCK_SIZE);
+}
+
+/* Makes [off, off + len) durable; msync only writes back the dirty pages in range */
+static void bdev_flush_range(struct blkdev *dev, off_t off, size_t len) {
+    if (bdev_failed(dev)) return;
+    __atomic_add_fetch(&dev->flushes, 1, __ATOMIC_RELAXED);
+    if (dev->map) {
+        off_t start = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        uint8_t *p = bdev_ptr(dev, start, len + (off - start));
+        if (p) bdev_check(dev, msync(p, len + (off - start), MS_SYNC), 0, "msync");
+        return;
+    }
+    bdev_check(dev, fdatasync(dev->fd), 0, "fdatasync");
+}
+
+static void bdev_flush(struct blkdev *dev) {
+    if (bdev_failed(dev)) return;
+    __atomic_add_fetch(&dev->flushes, 1, __ATOMIC_RELAXED);
+    if (dev->map)
+        bdev_check(dev, msync(dev->map, dev->map_len, MS_SYNC), 0, "msync");
+    else
+        bdev_check(dev, fdatasync(dev->fd), 0, "fdatasync");
+}
+
+/* Returns -1 if any access failed since bdev_open() */
+static int bdev_close(struct blkdev *dev) {
+#ifdef HAVE_LIBURING
+    if (dev->uring) {
+        io_uring_queue_exit(&dev->ring);
+        pthread_mutex_destroy(&dev->ring_lock);
+        dev->uring = 0;
+    }
+#endif
+    if (dev->map) {
+        bdev_check(dev, munmap(dev->map, dev->map_len), 0, "munmap");
+        dev->map = NULL;
+    }
+    if (dev->dfd >= 0) bdev_check(dev, close(dev->dfd), 0, "close");
+    dev->dfd = -1;
+    bdev_check(dev, close(dev->fd), 0, "close");
+    dev->fd = -1;
+    return bdev_failed(dev) ? -1 : 0;
+}
+
+/* Block cache: LRU cache of home-location blocks, keyed by block number.
+ * A mapped device needs no cache for clean blocks; lookups then resolve straight
+ * into the mapping. Pinned blocks hold committed-but-not-installed journal state:
+ * they are newer than their home location, are never evicted, and may push
+ * the cache past its capacity. Entries are only reached under the cache lock;
+ * callers get copies. */
+#define CACHE_BLOCKS_MIN 8
+#define CACHE_BUCKETS 256
+
+struct cache_entry {
+    uint32_t blk;
+    int pinned;
+    uint64_t lsn;       /* pinned: journal tail after the last transaction that wrote it */
+    uint64_t gen;       /* changes whenever data is loaded or replaced */
+    struct cache_entry *hnext;          /* hash chain */
+    struct cache_entry *prev, *next;    /* LRU list of unpinned blocks, most recent first */
+    uint8_t data[BLOCK_SIZE];
+};
+
+struct bcache {
+    struct blkdev *dev;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t slots;
+    struct cache_entry **entries;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *lru_head, *lru_tail;
+    uint64_t hits, misses;
+    uint64_t gen;
+    pthread_mutex_t lock;
+};
+
+static void bcache_init(struct bcache *c, struct blkdev *dev, uint32_t capacity) {
+    memset(c, 0, sizeof(*c));
+    c->dev = dev;
+    c->capacity = capacity < CACHE_BLOCKS_MIN ? CACHE_BLOCKS_MIN : capacity;
+    pthread_mutex_init(&c->lock, NULL);
+}
+
+static void lru_unlink(struct bcache *c, struct cache_entry *e) {
+    if (e->prev) e->prev->next = e->next; else c->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else c->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct bcache *c, struct cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->lru_head;
+    if (c->lru_head) c->lru_head->prev = e; else c->lru_tail = e;
+    c->lru_head = e;
+}
+
+static void hash_remove(struct bcache *c, struct cache_entry *e) {
+    struct cache_entry **pp = &c->buckets[e->blk % CACHE_BUCKETS];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->hnext = NULL;
+}
+
+static struct cache_entry *bcache_find(struct bcache *c, uint32_t blk) {
+    struct cache_entry *e;
+    for (e = c->buckets[blk % CACHE_BUCKETS]; e; e = e->hnext)
+        if (e->blk == blk)
+            return e;
+    return NULL;
+}
+
+static struct cache_entry *bcache_new_entry(struct bcache *c) {
+    if (c->used == c->slots) {
+        c->slots = c->slots ? c->slots * 2 : c->capacity;
+        c->entries = realloc(c->entries, c->slots * sizeof(*c->entries));
+        if (!c->entries) die("realloc");
+    }
+    struct cache_entry *e = calloc(1, sizeof(*e));
+    if (!e) die("calloc");
+    c->entries[c->used++] = e;
+    return e;
+}
+
+/* Returns the cached copy of blk, loading it (and evicting the LRU block) on a miss */
+static struct cache_entry *bcache_lookup(struct bcache *c, uint32_t blk, int load) {
+    struct cache_entry *e = bcache_find(c, blk);
+    if (e) {
+        c->hits++;
+        if (!e->pinned) {
+            lru_unlink(c, e);
+            lru_push_front(c, e);
+        }
+        return e;
+    }
+
+    c->misses++;
+    if (c->used < c->capacity || !c->lru_tail) {
+        e = bcache_new_entry(c);
+    } else {
+        e = c->lru_tail;
+        lru_unlink(c, e);
+        hash_remove(c, e);
+    }
+
+    e->blk = blk;
+    e->pinned = 0;
+    e->gen = ++c->gen;
+    if (load) bdev_read(c->dev, blk, e->data);
+    e->hnext = c->buckets[blk % CACHE_BUCKETS];
+    c->buckets[blk % CACHE_BUCKETS] = e;
+    lru_push_front(c, e);
+    return e;
+}
+
+/* Read-only view of blk, valid while the cache lock is held */
+static const uint8_t *bcache_get(struct bcache *c, uint32_t blk) {
+    static const uint8_t zeroes[BLOCK_SIZE];
+    if (c->dev->map) {
+        struct cache_entry *e = bcache_find(c, blk);
+        if (e) return e->data;
+        const uint8_t *p = bdev_ptr(c->dev, (off_t)blk * BLOCK_SIZE, BLOCK_SIZE);
+        return p && !bdev_failed(c->dev) ? p : zeroes;
+    }
+    return bcache_lookup(c, blk, 1)->data;
+}
+
+/* Copies blk to buf. Returns its generation: while the cached copy keeps
+ * it, the block has not changed. */
+static uint64_t bcache_read(struct bcache *c, uint32_t blk, void *buf) {
+    pthread_mutex_lock(&c->lock);
+    memcpy(buf, bcache_get(c, blk), BLOCK_SIZE);
+    struct cache_entry *e = bcache_find(c, blk);
+    uint64_t gen = e ? e->gen : 0;
+    pthread_mutex_unlock(&c->lock);
+    return gen;
+}
+
+/* Whether blk still holds buf, read at generation gen */
+static int bcache_unchanged(struct bcache *c, uint32_t blk, const void *buf, uint64_t gen) {
+    pthread_mutex_lock(&c->lock);
+    struct cache_entry *e = bcache_find(c, blk);
+    int same = gen && e && e->gen == gen;
+    if (!same) same = memcmp(bcache_get(c, blk), buf, BLOCK_SIZE) == 0;
+    pthread_mutex_unlock(&c->lock);
+    return same;
+}
+
+/* Copies blk to buf only if the cache holds it; returns whether it did */
+static int bcache_read_cached(struct bcache *c, uint32_t blk, void *buf) {
+    pthread_mutex_lock(&c->lock);
+    struct cache_entry *e = bcache_find(c, blk);
+    if (e) memcpy(buf, e->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->lock);
+    return e != NULL;
+}
+
+/* blk was written home as buf: a clean cached copy must match it, while a
+ * pinned one holds newer state */
+static void bcache_update_clean(struct bcache *c, uint32_t blk, const void *buf) {
+    pthread_mutex_lock(&c->lock);
+    struct cache_entry *e = bcache_find(c, blk);
+    if (e && !e->pinned) memcpy(e->data, buf, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Loads whichever of blks are not cached yet with one batch of reads. The
+ * batch stops before a miss would evict one of its own entries, which the
+ * reads, completing in any order, would then share. */
+static void bcache_prefetch(struct bcache *c, const uint32_t *blks, int n) {
+    if (c->dev->map) return;
+    struct bio b[CACHE_BLOCKS_MIN];
+    int k = 0;
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < n && k < CACHE_BLOCKS_MIN - 1; i++) {
+        if (bcache_find(c, blks[i])) continue;
+        struct cache_entry *victim = c->used >= c->capacity ? c->lru_tail : NULL;
+        int claimed = 0;
+        for (int j = 0; j < k && victim; j++)
+            claimed |= b[j].buf == victim->data;
+        if (claimed) break;
+        struct cache_entry *e = bcache_lookup(c, blks[i], 0);
+        b[k++] = (struct bio){.off = (off_t)blks[i] * BLOCK_SIZE, .buf = e->data, .len = BLOCK_SIZE};
+    }
+    bdev_submit(c->dev, 0, b, k, 0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Records a committed journal image of blk; it stays pinned until the
+ * transaction ending at lsn has been checkpointed */
+static void bcache_pin(struct bcache *c, uint32_t blk, const void *buf, uint64_t lsn) {
+    pthread_mutex_lock(&c->lock);
+    struct cache_entry *e = bcache_lookup(c, blk, 0);
+    memcpy(e->data, buf, BLOCK_SIZE);
+    e->lsn = lsn;
+    e->gen = ++c->gen;
+    if (!e->pinned) {
+        lru_unlink(c, e);
+        e->pinned = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* The journal up to lsn is checkpointed: images no later transaction touched
+ * now match their home location */
+static void bcache_unpin_upto(struct bcache *c, uint64_t lsn) {
+    pthread_mutex_lock(&c->lock);
+    for (uint32_t i = 0; i < c->used; i++) {
+        struct cache_entry *e = c->entries[i];
+        if (e->pinned && e->lsn <= lsn) {
+            e->pinned = 0;
+            lru_push_front(c, e);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void bcache_destroy(struct bcache *c) {
+    for (uint32_t i = 0; i < c->used; i++)
+        free(c->entries[i]);
+    free(c->entries);
+    c->entries = NULL;
+    c->used = c->slots = 0;
+    pthread_mutex_destroy(&c->lock);
+}
+
+/* A committed transaction's place in the log, until the header covers it */
+struct jres {
+    uint64_t end;
+    int done;           /* its records are written */
+};
+
+/* In-memory journal state; head and tail mirror the header once committed
+ * transactions have been found by journal_load() */
+struct journal {
+    uint64_t head, tail;
+    uint64_t written;       /* the header's tail: every record before it is written */
+    int header_checked;
+    uint32_t nblocks;       /* header block plus ring */
+    uint32_t capacity;      /* ring bytes */
+    uint64_t *txn_end;      /* end LSN of each committed transaction in [head, tail) */
+    uint32_t ntxn, txn_cap;
+    uint64_t installed_tid; /* last checkpointed transaction, as in the header */
+    uint64_t next_tid;
+    uint64_t checkpoints;   /* transactions checkpointed by this process */
+    uint64_t ckpt_records;  /* block records they contained */
+    uint64_t ckpt_blocks;   /* final images written home */
+    uint64_t ckpt_home_reads;
+
+    /* Group commit: committed transactions staged in memory, written with one
+     * write and made durable together. They start at tail - group_len. */
+    uint8_t *group;
+    size_t group_len;
+    uint32_t group_txns;
+    uint64_t group_start_ns;
+    uint64_t commits;
+    uint64_t opened_ns;
+
+    /* O_DIRECT journal: aligned staging for whole-block writes, and the
+     * partly filled block ending at dtail, rewritten by the next append */
+    uint8_t *dbuf;
+    size_t dbuf_len;
+    uint8_t *dblock;
+    uint8_t *dheader;
+    uint64_t dtail;
+
+    /* Concurrent appends (buffered journal, no group commit): a commit
+     * reserves [tail, tail + len) in commit order and writes its records
+     * after dropping the fs lock. Whichever writer finds no publisher at work
+     * becomes it and moves written over the finished reservations at the
+     * front with one header write. */
+    struct jres *res;       /* unpublished reservations, res[seq % res_cap] */
+    uint64_t res_first;     /* sequence number of the oldest */
+    uint32_t res_count, res_cap;
+    int publishing;
+    pthread_mutex_t pub_lock;   /* res and publishing; taken after the fs lock */
+    pthread_cond_t published;
+    pthread_mutex_t hdr_lock;   /* header writes, and head with installed_tid */
+
+    /* Background checkpointer (--checkpoint-at): woken after commits, it
+     * broadcasts space whenever it moves head */
+    int background;
+    int stop;
+    uint32_t space_waiters;
+    pthread_t checkpointer;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+
+    /* Group flusher (--group-latency): waits on staged for a group to start,
+     * then until its oldest transaction is due */
+    int flusher_running;
+    int flusher_stop;
+    pthread_t flusher;
+    pthread_cond_t staged;
+};
+
+/* A thread's way into the filesystem: its allocators search from their own
+ * starting points, so concurrent creates mostly touch different bitmap words
+ * and inode-table blocks */
+struct fs_handle {
+    struct fs *fs;
+    uint32_t inode_hint;    /* next-fit starting points for the allocators */
+    uint32_t data_hint;
+    uint64_t retries;       /* transactions rebuilt after a conflict */
+    struct claim *claims;   /* data runs claimed by the operation in progress */
+    uint32_t nclaims, claim_cap;
+};
+
+/* A run of data-bitmap bits */
+struct claim {
+    uint32_t bit;
+    uint32_t len;
+};
+
+/* Mounted filesystem: the device, its superblock and the block cache in front of it */
+struct fs {
+    struct blkdev dev;
+    struct superblock sb;
+    struct bcache cache;
+    struct fs_opts opts;
+    struct journal j;
+    struct fs_handle handle;        /* fs_create() and fs_write() */
+    uint32_t nhandles;
+    uint64_t retries;               /* of closed handles */
+    pthread_mutex_t lock;           /* commits and journal bookkeeping */
+    pthread_mutex_t ckpt_lock;      /* one checkpoint at a time; taken before lock */
+
+    /* Data blocks allocated by transactions not yet committed, one bitmap
+     * block of them per data-bitmap block, made on demand. fs_write() puts
+     * data in its blocks before it commits, so no other builder may take
+     * them, and a rebuilt write maps the same ones again. */
+    uint8_t **claimed;
+    pthread_mutex_t claim_lock;     /* claimed and handles' claims; taken before the cache lock */
+};
+
+static void fs_lock(struct fs *fs) {
+    pthread_mutex_lock(&fs->lock);
+}
+
+static void fs_unlock(struct fs *fs) {
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/* After an I/O error or corrupt metadata every operation fails: what they
+ * would read since may be wrong, and nothing more reaches the image */
+static int fs_failed(struct fs *fs) {
+    int err = bdev_failed(&fs->dev);
+    if (err) fprintf(stderr, "Image unusable after an earlier error: %s\n", strerror(err));
+    return err;
+}
+
+/* Journal Management Functions */
+static off_t journal_off(struct fs *fs, uint32_t pos) {
+    return (off_t)fs->sb.journal_block * BLOCK_SIZE + pos;
+}
+
+/* Ring I/O at a log sequence number; a range that runs off the end wraps to the start */
+static void journal_read(struct fs *fs, uint64_t lsn, void *buf, size_t len) {
+    uint32_t at = lsn % fs->j.capacity;
+    size_t first = len < fs->j.capacity - at ? len : fs->j.capacity - at;
+    bdev_pread(&fs->dev, journal_off(fs, BLOCK_SIZE + at), buf, first);
+    if (first < len)
+        bdev_pread(&fs->dev, journal_off(fs, BLOCK_SIZE), (uint8_t *)buf + first, len - first);
+}
+
+/* Reads the log between two LSNs into a new buffer with one read, or two where
+ * it wraps, so that records can be parsed in place. The caller frees it. */
+static uint8_t *journal_read_range(struct fs *fs, uint64_t from, uint64_t to) {
+    uint8_t *log = malloc(to > from ? to - from : 1);
+    if (!log) die("malloc");
+    journal_read(fs, from, log, to - from);
+    return log;
+}
+
+static uint8_t *aligned_alloc_blocks(size_t len) {
+    void *p;
+    if ((errno = posix_memalign(&p, BLOCK_SIZE, len))) die("posix_memalign");
+    return p;
+}
+
+/* Appends len bytes at lsn, the end of what is already on disk, through the
+ * O_DIRECT descriptor. Only whole blocks are written: the partial block at
+ * lsn is rebuilt from memory, the new records are packed after it and the
+ * rest of the last block is zeroed. journal_free_bytes() keeps a block of
+ * slack so that padding never reaches live records at head. */
+static void journal_write_direct(struct fs *fs, uint64_t lsn, const struct iovec *iov, int n,
+                                 size_t len) {
+    struct journal *j = &fs->j;
+    size_t pre = lsn % BLOCK_SIZE;
+    if (!j->dblock) {
+        j->dblock = aligned_alloc_blocks(BLOCK_SIZE);
+        if (pre) journal_read(fs, lsn - pre, j->dblock, BLOCK_SIZE);
+        j->dtail = lsn;
+    }
+    if (lsn != j->dtail) {
+        fprintf(stderr, "Direct journal write at %llu, expected %llu\n",
+                (unsigned long long)lsn, (unsigned long long)j->dtail);
+        bdev_error(&fs->dev, EIO);
+        return;
+    }
+
+    size_t total = pre + len;
+    size_t span = (total + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (span > j->dbuf_len) {
+        free(j->dbuf);
+        j->dbuf = aligned_alloc_blocks(span);
+        j->dbuf_len = span;
+    }
+    memcpy(j->dbuf, j->dblock, pre);
+    size_t at = pre;
+    for (int i = 0; i < n; i++) {
+        memcpy(j->dbuf + at, iov[i].iov_base, iov[i].iov_len);
+        at += iov[i].iov_len;
+    }
+    memset(j->dbuf + total, 0, span - total);
+
+    /* The ring is a whole number of blocks, so a wrap splits between blocks */
+    uint32_t ring_at = (lsn - pre) % j->capacity;
+    size_t first = span < j->capacity - ring_at ? span : j->capacity - ring_at;
+    bdev_pwrite_direct(&fs->dev, journal_off(fs, BLOCK_SIZE + ring_at), j->dbuf, first);
+    if (first < span)
+        bdev_pwrite_direct(&fs->dev, journal_off(fs, BLOCK_SIZE), j->dbuf + first, span - first);
+
+    memcpy(j->dblock, j->dbuf + span - BLOCK_SIZE, BLOCK_SIZE);
+    j->dtail = lsn + len;
+}
+
+static void journal_write(struct fs *fs, uint64_t lsn, const void *buf, size_t len) {
+    if (fs->dev.dfd >= 0) {
+        struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+        journal_write_direct(fs, lsn, &iov, 1, len);
+        return;
+    }
+    uint32_t at = lsn % fs->j.capacity;
+    size_t first = len < fs->j.capacity - at ? len : fs->j.capacity - at;
+    bdev_pwrite(&fs->dev, journal_off(fs, BLOCK_SIZE + at), buf, first);
+    if (first < len)
+        bdev_pwrite(&fs->dev, journal_off(fs, BLOCK_SIZE), (const uint8_t *)buf + first, len - first);
+}
+
+static uint64_t journal_written(struct journal *j) {
+    return __atomic_load_n(&j->written, __ATOMIC_SEQ_CST);
+}
+
+static struct journal_header journal_header_now(struct journal *j) {
+    return (struct journal_header){
+        .magic = JOURNAL_MAGIC, .head = j->head, .tail = journal_written(j),
+        .installed_tid = j->installed_tid
+    };
+}
+
+/* Writes the header, first moving written up to upto if that is past it */
+static void journal_publish(struct fs *fs, uint64_t upto) {
+    struct journal *j = &fs->j;
+    pthread_mutex_lock(&j->hdr_lock);
+    if (upto > j->written) __atomic_store_n(&j->written, upto, __ATOMIC_SEQ_CST);
+    struct journal_header jh = journal_header_now(j);
+    if (fs->dev.dfd >= 0) {
+        if (!j->dheader) j->dheader = aligned_alloc_blocks(BLOCK_SIZE);
+        memset(j->dheader, 0, BLOCK_SIZE);
+        memcpy(j->dheader, &jh, sizeof(jh));
+        bdev_pwrite_direct(&fs->dev, journal_off(fs, 0), j->dheader, BLOCK_SIZE);
+    } else {
+        bdev_pwrite(&fs->dev, journal_off(fs, 0), &jh, sizeof(jh));
+    }
+    pthread_mutex_unlock(&j->hdr_lock);
+}
+
+static void journal_write_header(struct fs *fs) {
+    journal_publish(fs, 0);
+}
+
+/* Writes the staged group and its header, then makes both durable with one
+ * flush. No barrier is needed between them: a transaction whose records did
+ * not all reach the disk fails its commit checksum and ends replay there. */
+static void journal_group_flush(struct fs *fs) {
+    struct journal *j = &fs->j;
+    if (j->group_len == 0) return;
+
+    journal_write(fs, j->tail - j->group_len, j->group, j->group_len);
+    journal_publish(fs, j->tail);
+    bdev_flush_range(&fs->dev, journal_off(fs, 0), (size_t)j->nblocks * BLOCK_SIZE);
+
+    j->group_len = 0;
+    j->group_txns = 0;
+}
+
+/* Flushes the group once it is large enough; journal_flusher() handles the
+ * latency bound */
+static void journal_group_maybe_flush(struct fs *fs) {
+    struct journal *j = &fs->j;
+    if (j->group_txns && j->group_txns >= fs->opts.group_max)
+        journal_group_flush(fs);
+}
+
+/* Once per mount, before the first commit; from then on only this process
+ * writes the header */
+static void init_journal_if_needed(struct fs *fs) {
+    if (fs->j.header_checked) return;
+    fs->j.header_checked = 1;
+
+    struct journal_header jh;
+    bdev_pread(&fs->dev, journal_off(fs, 0), &jh, sizeof(jh));
+
+    /* Rewriting also drops a torn tail, so new records do not join its
+     * transaction. The next TID must follow what the new header says. */
+    if (jh.magic != JOURNAL_MAGIC || jh.head != fs->j.head || jh.tail != fs->j.tail) {
+        fs->j.next_tid = fs->j.installed_tid + fs->j.ntxn + 1;
+        journal_write_header(fs);
+    }
+}
+
+/* Transaction builder: the records of one transaction as an iovec list.
+ * Record headers live in a small arena; payloads point straight into the
+ * transaction's block images, so nothing is copied before the write. */
+struct jbuilder {
+    struct iovec *iov;
+    int niov, cap;
+    uint8_t *hdrs;
+    size_t hdr_len;
+    size_t len;
+};
+
+static void jb_init(struct jbuilder *jb, size_t max_hdr_bytes) {
+    memset(jb, 0, sizeof(*jb));
+    jb->hdrs = malloc(max_hdr_bytes ? max_hdr_bytes : 1);
+    if (!jb->hdrs) die("malloc");
+}
+
+static void jb_add(struct jbuilder *jb, const void *p, size_t n) {
+    if (jb->niov == jb->cap) {
+        jb->cap = jb->cap ? jb->cap * 2 : 16;
+        jb->iov = realloc(jb->iov, jb->cap * sizeof(*jb->iov));
+        if (!jb->iov) die("realloc");
+    }
+    jb->iov[jb->niov].iov_base = (void *)p;
+    jb->iov[jb->niov].iov_len = n;
+    jb->niov++;
+    jb->len += n;
+}
+
+static void jb_add_hdr(struct jbuilder *jb, const void *hdr, size_t n) {
+    memcpy(jb->hdrs + jb->hdr_len, hdr, n);
+    jb_add(jb, jb->hdrs + jb->hdr_len, n);
+    jb->hdr_len += n;
+}
+
+static void jb_free(struct jbuilder *jb) {
+    free(jb->iov);
+    free(jb->hdrs);
+}
+
+/* Describes a gathered ring write at lsn as one bio, or two where it wraps.
+ * Returns the count; *split, if set, backs the bios and is the caller's to free. */
+static int journal_bios(struct fs *fs, uint64_t lsn, const struct iovec *iov, int n, size_t len,
+                        struct bio *b, struct iovec **split) {
+    uint32_t at = lsn % fs->j.capacity;
+    size_t first = len < fs->j.capacity - at ? len : fs->j.capacity - at;
+    *split = NULL;
+    b[0] = (struct bio){.off = journal_off(fs, BLOCK_SIZE + at), .iov = iov, .niov = n};
+    if (first == len) return 1;
+
+    struct iovec *sp = malloc((n + 1) * sizeof(*sp));
+    if (!sp) die("malloc");
+    int k = 0;
+    size_t done = 0;
+    while (done + iov[k].iov_len <= first)
+        done += iov[k++].iov_len;
+    memcpy(sp, iov, k * sizeof(*sp));
+    int nfirst = k;
+    if (done < first) {
+        sp[nfirst].iov_base = iov[k].iov_base;
+        sp[nfirst].iov_len = first - done;
+        nfirst++;
+    }
+    b[0].iov = sp;
+    b[0].niov = nfirst;
+
+    /* The second half reuses the array after the first half's entries */
+    struct iovec *rest = sp + nfirst;
+    rest[0].iov_base = (uint8_t *)iov[k].iov_base + (first - done);
+    rest[0].iov_len = iov[k].iov_len - (first - done);
+    memcpy(rest + 1, iov + k + 1, (n - k - 1) * sizeof(*rest));
+    b[1] = (struct bio){.off = journal_off(fs, BLOCK_SIZE), .iov = rest, .niov = n - k};
+    *split = sp;
+    return 2;
+}
+
+/* Appends a whole transaction at the tail with one gathered write, then
+ * publishes it with a single header update; the header is linked behind
+ * the records so it can never land first */
+static void journal_append(struct fs *fs, const struct jbuilder *jb) {
+    if (fs->dev.dfd >= 0) {
+        journal_write_direct(fs, fs->j.tail, jb->iov, jb->niov, jb->len);
+        fs->j.tail += jb->len;
+        journal_publish(fs, fs->j.tail);
+        return;
+    }
+
+    struct bio b[3];
+    struct iovec *split;
+    int n = journal_bios(fs, fs->j.tail, jb->iov, jb->niov, jb->len, b, &split);
+
+    fs->j.tail += jb->len;
+    __atomic_store_n(&fs->j.written, fs->j.tail, __ATOMIC_SEQ_CST);
+    struct journal_header jh = journal_header_now(&fs->j);
+    b[n++] = (struct bio){.off = journal_off(fs, 0), .buf = &jh, .len = sizeof(jh)};
+    bdev_submit(&fs->dev, 1, b, n, 1);
+    free(split);
+}
+
+/* Whether commits write their records outside the fs lock. Direct appends
+ * rewrite the shared partial block, group commit already batches them, and
+ * mapped images sync the journal at each commit point, so those stay serial. */
+static int journal_concurrent(struct fs *fs) {
+    return !fs->opts.group_max && fs->dev.dfd < 0 && !fs->dev.map;
+}
+
+/* Claims the next len bytes of the log, with the fs lock held. Returns the
+ * reservation's sequence number for journal_complete(). */
+static uint64_t journal_reserve(struct fs *fs, size_t len) {
+    struct journal *j = &fs->j;
+    pthread_mutex_lock(&j->pub_lock);
+    if (j->res_count == j->res_cap) {
+        uint32_t cap = j->res_cap ? j->res_cap * 2 : 16;
+        struct jres *res = malloc(cap * sizeof(*res));
+        if (!res) die("malloc");
+        for (uint64_t s = j->res_first; s < j->res_first + j->res_count; s++)
+            res[s % cap] = j->res[s % j->res_cap];
+        free(j->res);
+        j->res = res;
+        j->res_cap = cap;
+    }
+    uint64_t seq = j->res_first + j->res_count++;
+    j->tail += len;
+    j->res[seq % j->res_cap] = (struct jres){.end = j->tail};
+    pthread_mutex_unlock(&j->pub_lock);
+    return seq;
+}
+
+/* The records of reservation seq are written. Each header write publishes
+ * every finished reservation at the front, so a burst of concurrent commits
+ * shares a few header writes instead of queueing for one each. */
+static void journal_complete(struct fs *fs, uint64_t seq) {
+    struct journal *j = &fs->j;
+    pthread_mutex_lock(&j->pub_lock);
+    j->res[seq % j->res_cap].done = 1;
+    if (!j->publishing) {
+        j->publishing = 1;
+        for (;;) {
+            uint64_t upto = 0;
+            while (j->res_count && j->res[j->res_first % j->res_cap].done) {
+                upto = j->res[j->res_first % j->res_cap].end;
+                j->res_first++;
+                j->res_count--;
+            }
+            if (!upto) break;
+            pthread_mutex_unlock(&j->pub_lock);
+
+            journal_publish(fs, upto);
+            /* A committer waiting for space may need these checkpointed */
+            if (j->background && __atomic_load_n(&j->space_waiters, __ATOMIC_SEQ_CST)) {
+                fs_lock(fs);
+                pthread_cond_signal(&j->wake);
+                fs_unlock(fs);
+            }
+
+            pthread_mutex_lock(&j->pub_lock);
+            pthread_cond_broadcast(&j->published);
+        }
+        j->publishing = 0;
+    }
+    pthread_mutex_unlock(&j->pub_lock);
+}
+
+/* Waits until written moves past seen, if any reservation is outstanding */
+static void journal_wait_written(struct fs *fs, uint64_t seen) {
+    struct journal *j = &fs->j;
+    pthread_mutex_lock(&j->pub_lock);
+    while (j->res_count && journal_written(j) == seen)
+        pthread_cond_wait(&j->published, &j->pub_lock);
+    pthread_mutex_unlock(&j->pub_lock);
+}
+
+/* Copies one built transaction into the current group */
+static void journal_stage(struct fs *fs, const struct jbuilder *jb) {
+    struct journal *j = &fs->j;
+    if (!j->group) {
+        j->group = malloc(j->capacity);
+        if (!j->group) die("malloc");
+    }
+    if (j->group_txns == 0) {
+        j->group_start_ns = now_ns();
+        if (j->flusher_running) pthread_cond_signal(&j->staged);
+    }
+    for (int i = 0; i < jb->niov; i++) {
+        memcpy(j->group + j->group_len, jb->iov[i].iov_base, jb->iov[i].iov_len);
+        j->group_len += jb->iov[i].iov_len;
+    }
+    j->group_txns++;
+    j->tail += jb->len;
+}
+
+static int record_valid(const struct rec_header *rh) {
+    switch (rh->type) {
+    case REC_DATA:
+        return rh->size == sizeof(struct data_record);
+    case REC_DELTA:
+        return rh->size > sizeof(struct delta_record);
+    case REC_BEGIN:
+        return rh->size == sizeof(struct begin_record);
+    case REC_COMMIT:
+        return rh->size == sizeof(struct commit_record);
+    default:
+        return 0;
+    }
+}
+
+/* Applies one record on top of an image of its block */
+static uint32_t apply_record(const uint8_t *rec, uint8_t *block) {
+    struct rec_header rh;
+    memcpy(&rh, rec, sizeof(rh));
+
+    if (rh.type == REC_DATA) {
+        const struct data_record *dr = (const struct data_record *)rec;
+        memcpy(block, dr->data, BLOCK_SIZE);
+        return dr->block_no;
+    }
+    struct delta_record dh;
+    memcpy(&dh, rec, sizeof(dh));
+    memcpy(block + dh.offset, rec + sizeof(dh), dh.length);
+    return dh.block_no;
+}
+
+static uint32_t record_block(const uint8_t *rec) {
+    uint32_t blk;
+    memcpy(&blk, rec + sizeof(struct rec_header), sizeof(blk));
+    return blk;
+}
+
+static void journal_add_txn(struct journal *j, uint64_t end) {
+    if (j->ntxn == j->txn_cap) {
+        j->txn_cap = j->txn_cap ? j->txn_cap * 2 : 64;
+        j->txn_end = realloc(j->txn_end, j->txn_cap * sizeof(*j->txn_end));
+        if (!j->txn_end) die("realloc");
+    }
+    j->txn_end[j->ntxn++] = end;
+}
+
+/* Commit checksum of the records of a transaction starting at lsn */
+static uint32_t txn_crc(uint64_t lsn, const uint8_t *recs, size_t len,
+                        const struct commit_record *cr) {
+    uint32_t crc = crc32c(0, &lsn, sizeof(lsn));
+    crc = crc32c(crc, recs, len);
+    crc = crc32c(crc, &cr->hdr, sizeof(cr->hdr));
+    return crc32c(crc, &cr->tid, sizeof(cr->tid));
+}
+
+/* Replays every committed transaction into pinned cache blocks, so that the
+ * mounted view includes changes not yet installed to their home locations.
+ * Records are buffered until their commit record is seen; a trailing
+ * transaction without one is never applied. TIDs must continue from the
+ * header's installed_tid, so a stale transaction is rejected at its begin
+ * record without reading the rest of it. */
+static int journal_load(struct fs *fs) {
+    struct journal *j = &fs->j;
+    struct journal_header jh;
+    bdev_pread(&fs->dev, journal_off(fs, 0), &jh, sizeof(jh));
+
+    j->nblocks = fs->sb.inode_bitmap - fs->sb.journal_block;
+    j->capacity = (j->nblocks - 1) * BLOCK_SIZE;
+    j->head = j->tail = 0;
+    /* An empty or older-format journal starts over at TID 1 */
+    j->installed_tid = 0;
+    j->next_tid = 1;
+    if (jh.magic == JOURNAL_MAGIC_V1) {
+        /* The old linear format: { magic, nbytes_used } with records from byte 8 */
+        uint32_t nbytes_used;
+        memcpy(&nbytes_used, (uint8_t *)&jh + 4, sizeof(nbytes_used));
+        if (nbytes_used > 8) {
+            fprintf(stderr, "Journal uses the old linear format and is not empty; "
+                            "install it with the previous version first\n");
+            return -1;
+        }
+        return 0;
+    }
+    if ((jh.magic == JOURNAL_MAGIC_V2 || jh.magic == JOURNAL_MAGIC_V3) && jh.head != jh.tail) {
+        fprintf(stderr, "Journal has transactions in an older format; "
+                        "install it with the previous version first\n");
+        return -1;
+    }
+    /* Only a zeroed or empty older-format header is started over; anything
+     * else must not be overwritten by the next commit */
+    if (jh.magic == 0 || jh.magic == JOURNAL_MAGIC_V2 || jh.magic == JOURNAL_MAGIC_V3)
+        return 0;
+    if (jh.magic != JOURNAL_MAGIC || jh.head > jh.tail || jh.tail - jh.head > j->capacity) {
+        fprintf(stderr, "Journal not initialized or corrupted\n");
+        return -1;
+    }
+
+    j->head = j->tail = jh.head;
+    j->installed_tid = jh.installed_tid;
+    j->next_tid = jh.installed_tid + 1;
+    uint8_t *log = journal_read_range(fs, jh.head, jh.tail);
+    if (bdev_failed(&fs->dev)) {
+        free(log);
+        return -1;
+    }
+    uint64_t pos = jh.head;
+
+    while (pos < jh.tail) {
+        /* The open transaction's records are log[j->tail - head, pos - head) */
+        const uint8_t *rec = log + (pos - jh.head);
+        uint32_t pending_len = pos - j->tail;
+        struct rec_header rh = {0};
+        if (jh.tail - pos >= sizeof(rh))
+            memcpy(&rh, rec, sizeof(rh));
+
+        if (!record_valid(&rh) || pos + rh.size > jh.tail) {
+            fprintf(stderr, "Bad record type 0x%04x size %u at journal LSN %llu\n",
+                    rh.type, rh.size, (unsigned long long)pos);
+            break;
+        }
+        /* A transaction is a begin record, its block records and a commit */
+        if ((rh.type == REC_BEGIN) != (pending_len == 0) ||
+            (rh.type == REC_COMMIT && pending_len == sizeof(struct begin_record))) {
+            fprintf(stderr, "Record type 0x%04x out of place at journal LSN %llu\n",
+                    rh.type, (unsigned long long)pos);
+            break;
+        }
+        if (rh.type == REC_BEGIN) {
+            struct begin_record br;
+            memcpy(&br, rec, sizeof(br));
+            if (br.tid != j->next_tid) {
+                fprintf(stderr, "Journal LSN %llu holds transaction %llu where %llu was expected; "
+                        "replay stops there\n", (unsigned long long)pos,
+                        (unsigned long long)br.tid, (unsigned long long)j->next_tid);
+                break;
+            }
+        }
+
+        if (rh.type == REC_COMMIT) {
+            const uint8_t *pending = log + (j->tail - jh.head);
+            struct commit_record cr;
+            memcpy(&cr, rec, sizeof(cr));
+            if (cr.tid != j->next_tid || cr.crc != txn_crc(j->tail, pending, pending_len, &cr)) {
+                fprintf(stderr, "Transaction %llu at journal LSN %llu fails its checksum; "
+                        "replay stops there\n", (unsigned long long)j->next_tid,
+                        (unsigned long long)j->tail);
+                break;
+            }
+            for (uint32_t off = sizeof(struct begin_record); off < pending_len; ) {
+                struct rec_header prh;
+                memcpy(&prh, pending + off, sizeof(prh));
+                uint8_t block[BLOCK_SIZE];
+                uint32_t blk = record_block(pending + off);
+                bcache_read(&fs->cache, blk, block);
+                apply_record(pending + off, block);
+                bcache_pin(&fs->cache, blk, block, pos + rh.size);
+                off += prh.size;
+            }
+            j->tail = pos + rh.size;
+            j->next_tid++;
+            journal_add_txn(j, j->tail);
+        }
+        pos += rh.size;
+    }
+    free(log);
+    j->written = j->tail;
+    return 0;
+}
+
+/* Checkpoint replay works on the final image of each block in the range */
+#define REPLAY_BUCKETS 4096
+
+struct replay_block {
+    uint32_t blk;
+    int seeded;         /* data holds a whole image: home contents or a full record */
+    struct replay_block *hnext;
+    uint8_t data[BLOCK_SIZE];
+};
+
+/* Blocks with consecutive numbers after sorting, written by one pwritev */
+struct replay_run {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct replay {
+    struct blkdev *dev;
+    struct replay_block **blocks;
+    uint32_t nblocks, cap;
+    struct replay_block *buckets[REPLAY_BUCKETS];
+    struct replay_run *runs;
+    uint32_t nruns;
+    uint32_t next_run;      /* claimed by workers with an atomic add */
+};
+
+/* The image of blk being built; a delta needs the home contents underneath
+ * it, but a full record replaces them, so home is only read when a delta
+ * comes before any full record of the block */
+static struct replay_block *replay_block(struct replay *r, uint32_t blk) {
+    struct replay_block *rb;
+    for (rb = r->buckets[blk % REPLAY_BUCKETS]; rb; rb = rb->hnext)
+        if (rb->blk == blk) return rb;
+
+    if (r->nblocks == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 64;
+        r->blocks = realloc(r->blocks, r->cap * sizeof(*r->blocks));
+        if (!r->blocks) die("realloc");
+    }
+    rb = malloc(sizeof(*rb));
+    if (!rb) die("malloc");
+    rb->blk = blk;
+    rb->seeded = 0;
+    rb->hnext = r->buckets[blk % REPLAY_BUCKETS];
+    r->buckets[blk % REPLAY_BUCKETS] = rb;
+    r->blocks[r->nblocks++] = rb;
+    return rb;
+}
+
+static int cmp_replay_blk(const void *a, const void *b) {
+    uint32_t x = (*(struct replay_block *const *)a)->blk;
+    uint32_t y = (*(struct replay_block *const *)b)->blk;
+    return (x > y) - (x < y);
+}
+
+static void *replay_worker(void *arg) {
+    struct replay *r = arg;
+    struct iovec *iov = malloc(IOV_MAX * sizeof(*iov));
+    if (!iov) die("malloc");
+
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&r->next_run, 1, __ATOMIC_RELAXED);
+        if (i >= r->nruns) break;
+        struct replay_run *run = &r->runs[i];
+        for (uint32_t k = 0; k < run->count; k++) {
+            iov[k].iov_base = r->blocks[run->first + k]->data;
+            iov[k].iov_len = BLOCK_SIZE;
+        }
+        bdev_pwritev(r->dev, (off_t)r->blocks[run->first]->blk * BLOCK_SIZE, iov, run->count);
+    }
+    free(iov);
+    return NULL;
+}
+
+/* Writes every image home, sorted by block number; runs of adjacent blocks
+ * go out as one pwritev and up to nthreads of them are in flight at once,
+ * or the ring's depth with io_uring */
+static void replay_write(struct replay *r, uint32_t nthreads) {
+    qsort(r->blocks, r->nblocks, sizeof(*r->blocks), cmp_replay_blk);
+
+    r->runs = malloc((r->nblocks ? r->nblocks : 1) * sizeof(*r->runs));
+    if (!r->runs) die("malloc");
+    r->nruns = 0;
+    for (uint32_t i = 0; i < r->nblocks; i++) {
+        struct replay_run *run = r->nruns ? &r->runs[r->nruns - 1] : NULL;
+        if (run && run->count < IOV_MAX &&
+            r->blocks[run->first + run->count - 1]->blk + 1 == r->blocks[i]->blk)
+            run->count++;
+        else
+            r->runs[r->nruns++] = (struct replay_run){.first = i, .count = 1};
+    }
+
+#ifdef HAVE_LIBURING
+    /* The ring keeps URING_DEPTH runs in flight from this thread alone */
+    if (r->dev->uring) {
+        struct iovec *iov = malloc((r->nblocks ? r->nblocks : 1) * sizeof(*iov));
+        struct bio *b = malloc((r->nruns ? r->nruns : 1) * sizeof(*b));
+        if (!iov || !b) die("malloc");
+        for (uint32_t i = 0; i < r->nblocks; i++)
+            iov[i] = (struct iovec){.iov_base = r->blocks[i]->data, .iov_len = BLOCK_SIZE};
+        for (uint32_t i = 0; i < r->nruns; i++)
+            b[i] = (struct bio){.off = (off_t)r->blocks[r->runs[i].first]->blk * BLOCK_SIZE,
+                                .iov = iov + r->runs[i].first, .niov = r->runs[i].count};
+        bdev_submit(r->dev, 1, b, r->nruns, 0);
+        free(b);
+        free(iov);
+        return;
+    }
+#endif
+
+    if (nthreads > r->nruns) nthreads = r->nruns;
+    if (nthreads < 1) nthreads = 1;
+    pthread_t *tids = malloc(nthreads * sizeof(*tids));
+    if (!tids) die("malloc");
+    uint32_t started = 0;
+    /* Fewer writers than asked for only makes this slower */
+    while (started < nthreads - 1 && pthread_create(&tids[started], NULL, replay_worker, r) == 0)
+        started++;
+    replay_worker(r);
+    for (uint32_t i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+static void replay_free(struct replay *r) {
+    for (uint32_t i = 0; i < r->nblocks; i++)
+        free(r->blocks[i]);
+    free(r->blocks);
+    free(r->runs);
+}
+
+/* Gives up a checkpoint after an I/O error, leaving the journal as it was.
+ * Committers waiting for space are woken to see the error. */
+static uint32_t journal_checkpoint_failed(struct fs *fs) {
+    fs_lock(fs);
+    if (fs->j.background) pthread_cond_broadcast(&fs->j.space);
+    fs_unlock(fs);
+    pthread_mutex_unlock(&fs->ckpt_lock);
+    return 0;
+}
+
+/* Checkpoints the oldest max_txns committed transactions: parses their records,
+ * keeping only the final image of each block, writes those home in parallel
+ * and flushes once before the journal forgets them */
+static uint32_t journal_checkpoint(struct fs *fs, uint32_t max_txns) {
+    struct journal *j = &fs->j;
+
+    /* Only durable transactions may reach their home locations, and only
+     * published ones are sure to be complete. The checkpointer thread leaves
+     * a staged group to its committer. */
+    pthread_mutex_lock(&fs->ckpt_lock);
+    fs_lock(fs);
+    if (!j->background) journal_group_flush(fs);
+    uint64_t durable = journal_written(j);
+    uint32_t n = 0;
+    while (n < j->ntxn && n < max_txns && j->txn_end[n] <= durable) n++;
+    uint64_t head = j->head, upto = n ? j->txn_end[n - 1] : head;
+    fs_unlock(fs);
+    if (n == 0) {
+        pthread_mutex_unlock(&fs->ckpt_lock);
+        return 0;
+    }
+
+    /* Appends only write past tail and home locations of uncheckpointed
+     * blocks are only read through their pinned cache entries, so the log
+     * range and the home writes need no lock */
+    uint8_t *log = journal_read_range(fs, head, upto);
+    if (bdev_failed(&fs->dev)) {
+        free(log);
+        return journal_checkpoint_failed(fs);
+    }
+    struct replay *r = calloc(1, sizeof(*r));
+    if (!r) die("calloc");
+    r->dev = &fs->dev;
+
+    for (uint64_t pos = head; pos < upto; ) {
+        const uint8_t *rec = log + (pos - head);
+        struct rec_header rh;
+        memcpy(&rh, rec, sizeof(rh));
+        if (rh.type == REC_DATA || rh.type == REC_DELTA) {
+            struct replay_block *rb = replay_block(r, record_block(rec));
+            if (rh.type == REC_DELTA && !rb->seeded) {
+                bdev_read(&fs->dev, rb->blk, rb->data);
+                j->ckpt_home_reads++;
+            }
+            rb->seeded = 1;
+            apply_record(rec, rb->data);
+            j->ckpt_records++;
+        }
+        pos += rh.size;
+    }
+    free(log);
+
+    replay_write(r, fs->opts.install_threads);
+    j->ckpt_blocks += r->nblocks;
+
+    /* Home locations must be on disk before the journal forgets them */
+    bdev_flush(&fs->dev);
+    if (bdev_failed(&fs->dev)) {
+        replay_free(r);
+        free(r);
+        return journal_checkpoint_failed(fs);
+    }
+
+    fs_lock(fs);
+    for (uint32_t i = 0; i < r->nblocks; i++)
+        bcache_update_clean(&fs->cache, r->blocks[i]->blk, r->blocks[i]->data);
+
+    pthread_mutex_lock(&j->hdr_lock);
+    j->head = upto;
+    j->installed_tid += n;
+    pthread_mutex_unlock(&j->hdr_lock);
+    journal_write_header(fs);
+    bcache_unpin_upto(&fs->cache, upto);
+
+    memmove(j->txn_end, j->txn_end + n, (j->ntxn - n) * sizeof(*j->txn_end));
+    j->ntxn -= n;
+    j->checkpoints += n;
+    if (j->background) pthread_cond_broadcast(&j->space);
+    fs_unlock(fs);
+    pthread_mutex_unlock(&fs->ckpt_lock);
+
+    replay_free(r);
+    free(r);
+    return n;
+}
+
+/* Direct appends pad to a block boundary, so one block must stay unused */
+static size_t journal_usable(struct fs *fs) {
+    return fs->dev.dfd >= 0 ? fs->j.capacity - BLOCK_SIZE : fs->j.capacity;
+}
+
+static size_t journal_free_bytes(struct fs *fs) {
+    uint64_t used = fs->j.tail - fs->j.head;
+    return used < journal_usable(fs) ? journal_usable(fs) - used : 0;
+}
+
+static int journal_over_watermark(struct fs *fs) {
+    return (fs->j.tail - fs->j.head) * 100 >= (uint64_t)fs->j.capacity * fs->opts.checkpoint_at;
+}
+
+/* Checkpoints in the background whenever the log passes the watermark or a
+ * committer is waiting for space */
+static void *journal_checkpointer(void *arg) {
+    struct fs *fs = arg;
+    struct journal *j = &fs->j;
+
+    pthread_mutex_lock(&fs->lock);
+    while (!j->stop) {
+        if (j->ntxn && (j->space_waiters || journal_over_watermark(fs))) {
+            pthread_mutex_unlock(&fs->lock);
+            uint32_t n = journal_checkpoint(fs, UINT32_MAX);
+            pthread_mutex_lock(&fs->lock);
+            if (n || j->stop) continue;     /* stop may have been signalled meanwhile */
+        }
+        pthread_cond_wait(&j->wake, &fs->lock);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+static void journal_start_checkpointer(struct fs *fs) {
+    struct journal *j = &fs->j;
+    pthread_cond_init(&j->wake, NULL);
+    pthread_cond_init(&j->space, NULL);
+    j->background = 1;
+    int err = pthread_create(&j->checkpointer, NULL, journal_checkpointer, fs);
+    if (err) {
+        /* Committers checkpoint for themselves instead */
+        fprintf(stderr, "Cannot start the checkpointer: %s\n", strerror(err));
+        j->background = 0;
+        pthread_cond_destroy(&j->wake);
+        pthread_cond_destroy(&j->space);
+    }
+}
+
+static void journal_stop_checkpointer(struct fs *fs) {
+    struct journal *j = &fs->j;
+    if (!j->background) return;
+    pthread_mutex_lock(&fs->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&fs->lock);
+    pthread_join(j->checkpointer, NULL);
+    j->background = 0;
+    pthread_cond_destroy(&j->wake);
+    pthread_cond_destroy(&j->space);
+}
+
+/* Flushes each group once its oldest transaction has waited group_latency_ms,
+ * so the bound holds even when no further commit comes along to check it */
+static void *journal_flusher(void *arg) {
+    struct fs *fs = arg;
+    struct journal *j = &fs->j;
+    uint64_t latency = (uint64_t)fs->opts.group_latency_ms * 1000000u;
+
+    pthread_mutex_lock(&fs->lock);
+    while (!j->flusher_stop) {
+        if (!j->group_txns) {
+            pthread_cond_wait(&j->staged, &fs->lock);
+            continue;
+        }
+        uint64_t due = j->group_start_ns + latency;
+        if (now_ns() >= due) {
+            journal_group_flush(fs);
+            continue;
+        }
+        struct timespec ts = {.tv_sec = due / 1000000000u, .tv_nsec = due % 1000000000u};
+        pthread_cond_timedwait(&j->staged, &fs->lock, &ts);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+static int journal_start_flusher(struct fs *fs) {
+    struct journal *j = &fs->j;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);   /* the clock of now_ns() */
+    pthread_cond_init(&j->staged, &attr);
+    pthread_condattr_destroy(&attr);
+    int err = pthread_create(&j->flusher, NULL, journal_flusher, fs);
+    if (err) {
+        fprintf(stderr, "Cannot start the group commit flusher: %s\n", strerror(err));
+        pthread_cond_destroy(&j->staged);
+        return -1;
+    }
+    j->flusher_running = 1;
+    return 0;
+}
+
+static void journal_stop_flusher(struct fs *fs) {
+    struct journal *j = &fs->j;
+    if (!j->flusher_running) return;
+    pthread_mutex_lock(&fs->lock);
+    j->flusher_stop = 1;
+    pthread_cond_signal(&j->staged);
+    pthread_mutex_unlock(&fs->lock);
+    pthread_join(j->flusher, NULL);
+    j->flusher_running = 0;
+    pthread_cond_destroy(&j->staged);
+}
+
+static int read_superblock(struct blkdev *dev, struct superblock *sb) {
+    struct stat st;
+    if (!dev->map && (fstat(dev->fd, &st) < 0 || st.st_size < BLOCK_SIZE)) {
+        fprintf(stderr, "Image is too small to hold a superblock\n");
+        return -1;
+    }
+    bdev_pread(dev, 0, sb, sizeof(*sb));
+    if (bdev_failed(dev)) return -1;
+
+    if (sb->magic != FS_MAGIC) {
+        fprintf(stderr, "Invalid filesystem magic: 0x%08x\n", sb->magic);
+        return -1;
+    }
+    if (sb->block_size != BLOCK_SIZE ||
+        !(sb->journal_block > 0 && sb->journal_block + 2 <= sb->inode_bitmap &&
+          sb->inode_bitmap - sb->journal_block <= JOURNAL_BLOCKS_MAX &&
+          sb->inode_bitmap < sb->data_bitmap && sb->data_bitmap < sb->inode_start &&
+          sb->inode_start < sb->data_start && sb->data_start < sb->total_blocks)) {
+        fprintf(stderr, "Invalid filesystem geometry\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t fs_data_blocks(const struct superblock *sb) {
+    return sb->total_blocks - sb->data_start;
+}
+
+/* Inodes the bitmap and the inode table can both describe */
+static uint32_t fs_inode_limit(const struct superblock *sb) {
+    uint64_t limit = sb->inode_count;
+    uint64_t table = (uint64_t)(sb->data_start - sb->inode_start) * INODES_PER_BLOCK;
+    uint64_t bits = (uint64_t)(sb->data_bitmap - sb->inode_bitmap) * BITS_PER_BLOCK;
+    if (limit > table) limit = table;
+    if (limit > bits) limit = bits;
+    return limit;
+}
+
+struct fs *fs_open(const char *path, const struct fs_opts *opts) {
+    struct fs *fs = calloc(1, sizeof(*fs));
+    if (!fs) die("calloc");
+    fs->opts = *opts;
+    if (bdev_open(&fs->dev, path, opts->use_mmap, opts->use_uring) < 0) {
+        free(fs);
+        return NULL;
+    }
+    if (read_superblock(&fs->dev, &fs->sb) < 0) goto fail;
+    if (fs->dev.map && fs->dev.map_len < (size_t)fs->sb.total_blocks * BLOCK_SIZE) {
+        fprintf(stderr, "Image is smaller than its %u blocks\n", fs->sb.total_blocks);
+        goto fail;
+    }
+    if (opts->direct) {
+        if (fs->dev.map)
+            fprintf(stderr, "--direct does not apply to a mapped image\n");
+        else if (bdev_open_direct(&fs->dev, path) < 0)
+            fprintf(stderr, "O_DIRECT unavailable (%s), journal writes stay buffered\n",
+                    strerror(errno));
+    }
+    bcache_init(&fs->cache, &fs->dev, opts->cache_blocks);
+    if (journal_load(fs) < 0 || bdev_failed(&fs->dev)) {
+        bcache_destroy(&fs->cache);
+        free(fs->j.txn_end);
+        goto fail;
+    }
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->ckpt_lock, NULL);
+    pthread_mutex_init(&fs->claim_lock, NULL);
+    fs->claimed = calloc(fs->sb.inode_start - fs->sb.data_bitmap, sizeof(*fs->claimed));
+    if (!fs->claimed) die("calloc");
+    pthread_mutex_init(&fs->j.pub_lock, NULL);
+    pthread_mutex_init(&fs->j.hdr_lock, NULL);
+    pthread_cond_init(&fs->j.published, NULL);
+    fs->handle.fs = fs;
+    fs->j.opened_ns = now_ns();
+    if (opts->group_max && opts->group_latency_ms && journal_start_flusher(fs) < 0) {
+        fs_close(fs);
+        return NULL;
+    }
+    return fs;
+
+fail:
+    bdev_close(&fs->dev);
+    free(fs);
+    return NULL;
+}
+
+void fs_start_checkpointer(struct fs *fs) {
+    if (fs->opts.checkpoint_at && !fs->j.background)
+        journal_start_checkpointer(fs);
+}
+
+int fs_close(struct fs *fs) {
+    journal_stop_checkpointer(fs);
+    journal_stop_flusher(fs);
+    journal_group_flush(fs);
+    if (fs->opts.stats && !fs->dev.map) {
+        struct bcache *c = &fs->cache;
+        uint64_t lookups = c->hits + c->misses;
+        fprintf(stderr, "cache: %u blocks, %llu hits, %llu misses (%.1f%% hit)\n",
+                c->capacity, (unsigned long long)c->hits, (unsigned long long)c->misses,
+                lookups ? 100.0 * c->hits / lookups : 0.0);
+    }
+    if (fs->opts.stats) {
+        double secs = (now_ns() - fs->j.opened_ns) / 1e9;
+        fprintf(stderr, "journal: %llu commits, %llu fsyncs, %llu checkpointed in %.3f s "
+                "(%.0f commits/s, %.0f fsyncs/s)\n",
+                (unsigned long long)fs->j.commits, (unsigned long long)fs->dev.flushes,
+                (unsigned long long)fs->j.checkpoints, secs,
+                fs->j.commits / secs, fs->dev.flushes / secs);
+        if (fs->j.checkpoints)
+            fprintf(stderr, "checkpoint: %llu records collapsed into %llu block writes, "
+                    "%llu home reads\n",
+                    (unsigned long long)fs->j.ckpt_records, (unsigned long long)fs->j.ckpt_blocks,
+                    (unsigned long long)fs->j.ckpt_home_reads);
+        if (fs->retries + fs->handle.retries)
+            fprintf(stderr, "txn: %llu rebuilt after a conflict\n",
+                    (unsigned long long)(fs->retries + fs->handle.retries));
+    }
+    bcache_destroy(&fs->cache);
+    free(fs->j.txn_end);
+    free(fs->j.group);
+    free(fs->j.dbuf);
+    free(fs->j.dblock);
+    free(fs->j.dheader);
+    pthread_mutex_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->ckpt_lock);
+    pthread_mutex_destroy(&fs->claim_lock);
+    for (uint32_t b = 0; b < fs->sb.inode_start - fs->sb.data_bitmap; b++)
+        free(fs->claimed[b]);
+    free(fs->claimed);
+    free(fs->handle.claims);
+    pthread_mutex_destroy(&fs->j.pub_lock);
+    pthread_mutex_destroy(&fs->j.hdr_lock);
+    pthread_cond_destroy(&fs->j.published);
+    free(fs->j.res);
+    int rc = bdev_close(&fs->dev);
+    free(fs);
+    return rc;
+}
+
+/* Transactions: in-memory images of every block an update reads or writes.
+ * Each changed block is logged exactly once, followed by one commit record.
+ *
+ * Transactions are built without any lock, from private copies, and checked
+ * at commit under the fs lock (optimistic concurrency): every block must
+ * still hold what the transaction first read, or the caller rebuilds it.
+ * Bitmap and inode-table blocks are shared by nearly every update, so they
+ * are checked at a finer grain: only the bits and inode slots a transaction
+ * used must be untouched, and others' changes elsewhere in the block are
+ * merged in. */
+#define TXN_BUCKETS 256
+#define TXN_CONFLICT 1      /* txn_commit(): another commit invalidated what it read */
+
+enum txn_kind {
+    TXN_WHOLE,      /* any concurrent change conflicts */
+    TXN_BITMAP,     /* only changes to the bits this transaction changed conflict */
+    TXN_INODES      /* only changes to the slots in txn_block.slots conflict */
+};
+
+struct txn_block {
+    uint32_t blk;
+    enum txn_kind kind;
+    int written;                /* data is set up; only such blocks are logged */
+    uint32_t slots;             /* TXN_INODES: inodes this transaction used */
+    uint64_t gen;               /* cache generation orig was read at */
+    struct txn_block *hnext;    /* hash chain */
+    uint8_t orig[BLOCK_SIZE];   /* image when first touched, to log only what changed */
+    uint8_t data[BLOCK_SIZE];   /* copied from orig on the first write */
+};
+
+_Static_assert(INODES_PER_BLOCK <= 32, "txn_block.slots has one bit per inode of a block");
+
+struct txn {
+    struct fs *fs;
+    struct fs_handle *h;        /* whose allocator hints it advances */
+    uint32_t nblocks;
+    uint32_t cap;
+    struct txn_block **blocks;
+    struct txn_block *buckets[TXN_BUCKETS];
+};
+
+static void txn_begin(struct txn *t, struct fs_handle *h) {
+    t->fs = h->fs;
+    t->h = h;
+    t->nblocks = 0;
+    t->cap = 0;
+    t->blocks = NULL;
+    memset(t->buckets, 0, sizeof(t->buckets));
+}
+
+static struct txn_block *txn_find(struct txn *t, uint32_t blk) {
+    struct txn_block *tb;
+    for (tb = t->buckets[blk % TXN_BUCKETS]; tb; tb = tb->hnext)
+        if (tb->blk == blk) break;
+    return tb;
+}
+
+/* The transaction's image of blk, copied from the cache on first use. A block
+ * used as more than one kind is checked whole. */
+static struct txn_block *txn_load(struct txn *t, uint32_t blk, enum txn_kind kind) {
+    struct txn_block *tb = txn_find(t, blk);
+    if (tb) {
+        if (tb->kind != kind) tb->kind = TXN_WHOLE;
+        return tb;
+    }
+
+    if (t->nblocks == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 8;
+        t->blocks = realloc(t->blocks, t->cap * sizeof(*t->blocks));
+        if (!t->blocks) die("realloc");
+    }
+    tb = malloc(sizeof(*tb));
+    if (!tb) die("malloc");
+    tb->blk = blk;
+    tb->kind = kind;
+    tb->written = 0;
+    tb->slots = 0;
+    tb->hnext = t->buckets[blk % TXN_BUCKETS];
+    t->buckets[blk % TXN_BUCKETS] = tb;
+    tb->gen = bcache_read(&t->fs->cache, blk, tb->orig);
+    t->blocks[t->nblocks++] = tb;
+    return tb;
+}
+
+/* A pointer from txn_view() does not see writes made after it was taken */
+static const uint8_t *txn_view(const struct txn_block *tb) {
+    return tb->written ? tb->data : tb->orig;
+}
+
+static uint8_t *txn_write(struct txn_block *tb) {
+    if (!tb->written) {
+        memcpy(tb->data, tb->orig, BLOCK_SIZE);
+        tb->written = 1;
+    }
+    return tb->data;
+}
+
+/* Read-only image of blk as this transaction sees it */
+static const uint8_t *txn_peek(struct txn *t, uint32_t blk) {
+    return txn_view(txn_load(t, blk, TXN_WHOLE));
+}
+
+/* Writable image of blk as this transaction sees it */
+static uint8_t *txn_get(struct txn *t, uint32_t blk) {
+    return txn_write(txn_load(t, blk, TXN_WHOLE));
+}
+
+static void txn_end(struct txn *t) {
+    for (uint32_t i = 0; i < t->nblocks; i++)
+        free(t->blocks[i]);
+    free(t->blocks);
+    t->blocks = NULL;
+    t->nblocks = t->cap = 0;
+    memset(t->buckets, 0, sizeof(t->buckets));
+}
+
+/* Changed bytes closer together than a delta header are cheaper logged as one range */
+#define DELTA_MERGE_GAP sizeof(struct delta_record)
+
+/* Adds the changes to tb as delta records, or as one full data record when
+ * that is smaller. Returns the bytes added (0 if unchanged). */
+static size_t txn_encode_block(const struct txn_block *tb, struct jbuilder *jb) {
+    struct jbuilder mark = *jb;
+    size_t n = 0;
+    uint32_t i = 0;
+    int full = 0;
+
+    while (i < BLOCK_SIZE) {
+        if (tb->data[i] == tb->orig[i]) {
+            i++;
+            continue;
+        }
+        uint32_t start = i, end = i + 1, gap = 0;
+        for (i++; i < BLOCK_SIZE && gap < DELTA_MERGE_GAP; i++) {
+            if (tb->data[i] != tb->orig[i]) {
+                end = i + 1;
+                gap = 0;
+            } else {
+                gap++;
+            }
+        }
+        i = end;
+
+        struct delta_record dh = {
+            .hdr = {.type = REC_DELTA, .size = sizeof(struct delta_record) + (end - start)},
+            .block_no = tb->blk,
+            .offset = start,
+            .length = end - start
+        };
+        if (n + dh.hdr.size >= sizeof(struct data_record)) {
+            full = 1;
+            break;
+        }
+        jb_add_hdr(jb, &dh, sizeof(dh));
+        jb_add(jb, tb->data + start, end - start);
+        n += dh.hdr.size;
+    }
+
+    if (full) {
+        /* Roll back the deltas; the arena and iovec array only ever grow */
+        jb->niov = mark.niov;
+        jb->hdr_len = mark.hdr_len;
+        jb->len = mark.len;
+        struct data_record dh = {
+            .hdr = {.type = REC_DATA, .size = sizeof(struct data_record)},
+            .block_no = tb->blk
+        };
+        jb_add_hdr(jb, &dh, offsetof(struct data_record, data));
+        jb_add(jb, tb->data, BLOCK_SIZE);
+        n = sizeof(struct data_record);
+    }
+    return n;
+}
+
+/* Creating a file in a hashed directory only bumps the directory's size and
+ * mtime. Those commute, so such updates to the same inode merge: the size
+ * deltas add up and the later mtime wins. Returns -1 for any other change. */
+static int inode_merge_dir(const struct inode *cur, struct inode *orig, struct inode *data) {
+    if (cur->type != INODE_TYPE_DIR || !(cur->flags & INODE_FLAG_HASHED)) return -1;
+    struct inode a = *cur, b = *orig, c = *data;
+    a.size = b.size = c.size = 0;
+    a.mtime = b.mtime = c.mtime = 0;
+    if (memcmp(&a, &b, sizeof(a)) != 0 || memcmp(&b, &c, sizeof(b)) != 0) return -1;
+
+    data->size = cur->size + (data->size - orig->size);
+    if (data->mtime < cur->mtime) data->mtime = cur->mtime;
+    *orig = *cur;
+    return 0;
+}
+
+/* Brings tb up to date with the committed image cur. Returns -1 if a change
+ * made since tb was read conflicts with what this transaction did. */
+static int txn_rebase_block(struct txn_block *tb, const uint8_t *cur) {
+    switch (tb->kind) {
+    case TXN_WHOLE:
+        return -1;
+
+    case TXN_BITMAP:
+        for (uint32_t off = 0; off < BLOCK_SIZE; off += sizeof(uint64_t)) {
+            uint64_t c, o, d;
+            memcpy(&c, cur + off, sizeof(c));
+            memcpy(&o, tb->orig + off, sizeof(o));
+            memcpy(&d, tb->data + off, sizeof(d));
+            uint64_t mine = o ^ d;
+            if ((c ^ o) & mine) return -1;
+            d = c ^ mine;
+            memcpy(tb->data + off, &d, sizeof(d));
+        }
+        memcpy(tb->orig, cur, BLOCK_SIZE);
+        return 0;
+
+    case TXN_INODES:
+        for (uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
+            size_t off = (size_t)i * INODE_SIZE;
+            if (memcmp(cur + off, tb->orig + off, INODE_SIZE) == 0) continue;
+            if (tb->slots & (1u << i)) {
+                if (inode_merge_dir((const struct inode *)(cur + off),
+                                    (struct inode *)(tb->orig + off),
+                                    (struct inode *)(tb->data + off)) < 0)
+                    return -1;
+                continue;
+            }
+            memcpy(tb->orig + off, cur + off, INODE_SIZE);
+            memcpy(tb->data + off, cur + off, INODE_SIZE);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Checks every block against the committed state, with the fs lock held */
+static int txn_validate(struct txn *t) {
+    uint8_t cur[BLOCK_SIZE];
+    for (uint32_t i = 0; i < t->nblocks; i++) {
+        struct txn_block *tb = t->blocks[i];
+        if (bcache_unchanged(&t->fs->cache, tb->blk, tb->orig, tb->gen)) continue;
+        tb->gen = bcache_read(&t->fs->cache, tb->blk, cur);
+        if (!tb->written) memcpy(tb->data, tb->orig, BLOCK_SIZE);
+        if (txn_rebase_block(tb, cur) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Adds the commit record, whose checksum covers the start LSN and every record */
+static void txn_seal(struct jbuilder *jb, uint64_t lsn, struct commit_record *cr) {
+    uint32_t crc = crc32c(0, &lsn, sizeof(lsn));
+    for (int i = 0; i < jb->niov; i++)
+        crc = crc32c(crc, jb->iov[i].iov_base, jb->iov[i].iov_len);
+    crc = crc32c(crc, &cr->hdr, sizeof(cr->hdr));
+    cr->crc = crc32c(crc, &cr->tid, sizeof(cr->tid));
+    jb_add_hdr(jb, cr, sizeof(*cr));
+}
+
+/* Commits t. Called with the fs lock held, which it releases: where the
+ * journal allows, the records are written after that. Returns TXN_CONFLICT,
+ * with nothing written, if the transaction must be rebuilt. */
+static int txn_commit(struct txn *t) {
+    struct fs *fs = t->fs;
+    struct jbuilder jb;
+    size_t len;
+
+    for (;;) {
+        if (bdev_failed(&fs->dev)) {
+            fs_unlock(fs);
+            return -1;
+        }
+        if (txn_validate(t) < 0) {
+            fs_unlock(fs);
+            return TXN_CONFLICT;
+        }
+
+        /* Headers never outweigh the records they belong to, and per block the
+         * encoding never exceeds one full data record */
+        jb_init(&jb, sizeof(struct begin_record) + t->nblocks * sizeof(struct data_record) +
+                     sizeof(struct commit_record));
+        struct begin_record br = {.hdr = {.type = REC_BEGIN, .size = sizeof(struct begin_record)}};
+        jb_add_hdr(&jb, &br, sizeof(br));
+        for (uint32_t i = 0; i < t->nblocks; i++)
+            if (t->blocks[i]->written)
+                txn_encode_block(t->blocks[i], &jb);
+
+        len = jb.len + sizeof(struct commit_record);
+        if (len > journal_usable(fs)) {
+            fprintf(stderr, "Transaction of %zu bytes does not fit in the journal\n", len);
+            jb_free(&jb);
+            fs_unlock(fs);
+            return -1;
+        }
+        if (journal_free_bytes(fs) >= len) break;
+        jb_free(&jb);
+
+        /* Make room by checkpointing instead of failing. Both ways drop the
+         * lock, so others may commit meanwhile. */
+        if (!fs->j.background) {
+            /* Everything durable goes at once, so a full ring costs one flush
+             * per refill rather than per commit. Nothing can go yet if the
+             * oldest is still being written. */
+            uint64_t written = journal_written(&fs->j);
+            fs_unlock(fs);
+            if (journal_checkpoint(fs, UINT32_MAX) == 0)
+                journal_wait_written(fs, written);
+            fs_lock(fs);
+            continue;
+        }
+        /* Staged transactions must be durable before they can be checkpointed */
+        journal_group_flush(fs);
+        __atomic_add_fetch(&fs->j.space_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&fs->j.wake);
+        pthread_cond_wait(&fs->j.space, &fs->lock);
+        __atomic_sub_fetch(&fs->j.space_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    /* The TID is taken only once the transaction is sure to be written, and
+     * it starts at the current tail whether appended, staged or reserved */
+    struct commit_record cr = {
+        .hdr = {.type = REC_COMMIT, .size = sizeof(struct commit_record)},
+        .tid = fs->j.next_tid++
+    };
+    memcpy(jb.hdrs + offsetof(struct begin_record, tid), &cr.tid, sizeof(cr.tid));
+    uint64_t start = fs->j.tail, seq = 0;
+    int concurrent = journal_concurrent(fs);
+
+    if (concurrent) {
+        seq = journal_reserve(fs, len);
+    } else {
+        txn_seal(&jb, start, &cr);
+        if (fs->opts.group_max)
+            journal_stage(fs, &jb);
+        else
+            journal_append(fs, &jb);
+    }
+
+    fs->j.commits++;
+    journal_add_txn(&fs->j, start + len);
+
+    /* Later transactions in this process build on the committed images */
+    for (uint32_t i = 0; i < t->nblocks; i++) {
+        struct txn_block *tb = t->blocks[i];
+        if (tb->written)
+            bcache_pin(&fs->cache, tb->blk, tb->data, start + len);
+    }
+
+    if (fs->opts.group_max)
+        journal_group_maybe_flush(fs);
+    else if (fs->dev.map)   /* mapped images are made durable at commit points */
+        bdev_flush_range(&fs->dev, journal_off(fs, 0), (size_t)fs->j.nblocks * BLOCK_SIZE);
+
+    if (fs->j.background && journal_over_watermark(fs))
+        pthread_cond_signal(&fs->j.wake);
+    fs_unlock(fs);
+
+    /* The order is fixed; checksumming and writing the records can overlap
+     * with other commits */
+    if (concurrent) {
+        txn_seal(&jb, start, &cr);
+        struct bio b[2];
+        struct iovec *split;
+        int n = journal_bios(fs, start, jb.iov, jb.niov, jb.len, b, &split);
+        bdev_submit(&fs->dev, 1, b, n, 0);
+        free(split);
+        journal_complete(fs, seq);
+    }
+    jb_free(&jb);
+    return bdev_failed(&fs->dev) ? -1 : 0;
+}
+
+/* Bitmap block b of the data bitmap as a claiming allocator must see it: the
+ * transaction's image, plus bits committed since it was loaded, plus the
+ * claims of transactions still being built. With the claim lock held. */
+static const uint8_t *claim_view(struct txn *t, uint32_t b, const uint8_t *view, uint8_t *out) {
+    struct fs *fs = t->fs;
+    bcache_read(&fs->cache, fs->sb.data_bitmap + b, out);
+    const uint8_t *claimed = fs->claimed[b];
+    for (uint32_t off = 0; off < BLOCK_SIZE; off += sizeof(uint64_t)) {
+        uint64_t w, v, c = 0;
+        memcpy(&w, out + off, sizeof(w));
+        memcpy(&v, view + off, sizeof(v));
+        if (claimed) memcpy(&c, claimed + off, sizeof(c));
+        w |= v | c;
+        memcpy(out + off, &w, sizeof(w));
+    }
+    return out;
+}
+
+/* Records [bit, bit + len) of data-bitmap block b as claimed by h. With the
+ * claim lock held. */
+static void claim_add(struct fs_handle *h, uint32_t b, uint32_t bit, uint32_t len) {
+    struct fs *fs = h->fs;
+    if (!fs->claimed[b] && !(fs->claimed[b] = calloc(1, BLOCK_SIZE))) die("calloc");
+    bitmap_set_range(fs->claimed[b], bit, bit + len);
+    if (h->nclaims == h->claim_cap) {
+        h->claim_cap = h->claim_cap ? h->claim_cap * 2 : 16;
+        h->claims = realloc(h->claims, h->claim_cap * sizeof(*h->claims));
+        if (!h->claims) die("realloc");
+    }
+    h->claims[h->nclaims++] = (struct claim){.bit = b * BITS_PER_BLOCK + bit, .len = len};
+}
+
+/* Drops h's claims once its operation has committed, when the blocks are
+ * marked in the committed bitmap, or has failed */
+static void claims_release(struct fs_handle *h) {
+    struct fs *fs = h->fs;
+    if (!h->nclaims) return;
+    pthread_mutex_lock(&fs->claim_lock);
+    for (uint32_t i = 0; i < h->nclaims; i++) {
+        uint32_t b = h->claims[i].bit / BITS_PER_BLOCK, bit = h->claims[i].bit % BITS_PER_BLOCK;
+        bitmap_clear_range(fs->claimed[b], bit, bit + h->claims[i].len);
+    }
+    h->nclaims = 0;
+    pthread_mutex_unlock(&fs->claim_lock);
+}
+
+/* The bitmap txn_alloc_run() searches; tb is the block last handed out */
+struct alloc_ctx {
+    struct txn *t;
+    uint32_t bmap_start;
+    int claim;
+    struct txn_block *tb;
+    uint8_t merged[BLOCK_SIZE];
+};
+
+static const uint8_t *alloc_block(void *arg, uint32_t b) {
+    struct alloc_ctx *a = arg;
+    a->tb = txn_load(a->t, a->bmap_start + b, TXN_BITMAP);
+    const uint8_t *bmap = txn_view(a->tb);
+    return a->claim ? claim_view(a->t, b, bmap, a->merged) : bmap;
+}
+
+/* Allocates a run of up to want free bits from a multi-block bitmap with
+ * bitmap_next_fit() from *hint. Returns the first bit and sets *got to the
+ * run length, or -1 when the bitmap is full. With claim set (data bitmap
+ * only), skips blocks other builders hold and claims the run for t's handle. */
+static int64_t txn_alloc_run(struct txn *t, uint32_t bmap_start, uint32_t nbits, uint32_t want,
+                             uint32_t *hint, uint32_t *got, int claim) {
+    struct alloc_ctx a = {.t = t, .bmap_start = bmap_start, .claim = claim};
+
+    if (claim) pthread_mutex_lock(&t->fs->claim_lock);
+    int64_t bit = bitmap_next_fit(nbits, BITS_PER_BLOCK, want, hint, got, alloc_block, &a);
+    if (bit >= 0) {
+        uint32_t i = bit % BITS_PER_BLOCK;
+        bitmap_set_range(txn_write(a.tb), i, i + *got);
+        if (claim) claim_add(t->h, bit / BITS_PER_BLOCK, i, *got);
+    }
+    if (claim) pthread_mutex_unlock(&t->fs->claim_lock);
+    return bit;
+}
+
+static int64_t txn_alloc_bit(struct txn *t, uint32_t bmap_start, uint32_t nbits, uint32_t *hint) {
+    uint32_t got;
+    return txn_alloc_run(t, bmap_start, nbits, 1, hint, &got, 0);
+}
+
+/* Data block numbers, not bitmap bits */
+static int64_t txn_alloc_data_run(struct txn *t, uint32_t want, uint32_t *got) {
+    struct superblock *sb = &t->fs->sb;
+    int64_t bit = txn_alloc_run(t, sb->data_bitmap, fs_data_blocks(sb), want, &t->h->data_hint,
+                                got, 1);
+    return bit < 0 ? -1 : sb->data_start + bit;
+}
+
+/* Marks a run t's handle already claimed, for a rebuilt transaction */
+static void txn_mark_data(struct txn *t, uint32_t pblk, uint32_t len) {
+    struct superblock *sb = &t->fs->sb;
+    uint32_t bit = pblk - sb->data_start;
+    struct txn_block *tb = txn_load(t, sb->data_bitmap + bit / BITS_PER_BLOCK, TXN_BITMAP);
+    bitmap_set_range(txn_write(tb), bit % BITS_PER_BLOCK, bit % BITS_PER_BLOCK + len);
+}
+
+static int64_t txn_alloc_data(struct txn *t) {
+    uint32_t got;
+    return txn_alloc_data_run(t, 1, &got);
+}
+
+/* Directories */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    for (int i = 0; i < NAME_LEN - 1 && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int name_eq(const struct dirent *de, const char *name) {
+    return strncmp(de->name, name, NAME_LEN - 1) == 0;
+}
+
+static uint32_t dx_nbuckets(struct txn *t, const struct inode *dir) {
+    const struct dx_root *dx = (const struct dx_root *)txn_peek(t, dir->direct[0]);
+    return DX_ROOT_BUCKETS + (dx->index_blocks - 1) * DX_BUCKETS_PER_BLOCK;
+}
+
+static uint32_t dx_bucket(struct txn *t, const struct inode *dir, const char *name) {
+    return name_hash(name) % dx_nbuckets(t, dir);
+}
+
+/* Block and byte offset of bucket h in the index of dir */
+static void dx_slot(const struct inode *dir, uint32_t h, uint32_t *blk, uint32_t *off) {
+    if (h < DX_ROOT_BUCKETS) {
+        *blk = dir->direct[0];
+        *off = offsetof(struct dx_root, bucket) + h * sizeof(uint32_t);
+    } else {
+        h -= DX_ROOT_BUCKETS;
+        *blk = dir->direct[1 + h / DX_BUCKETS_PER_BLOCK];
+        *off = (h % DX_BUCKETS_PER_BLOCK) * sizeof(uint32_t);
+    }
+}
+
+static uint32_t dx_get(struct txn *t, const struct inode *dir, uint32_t h) {
+    uint32_t blk, off, leaf;
+    dx_slot(dir, h, &blk, &off);
+    memcpy(&leaf, txn_peek(t, blk) + off, sizeof(leaf));
+    return leaf;
+}
+
+/* Points buckets [from, to) at leaf */
+static void dx_set(struct txn *t, const struct inode *dir, uint32_t from, uint32_t to,
+                   uint32_t leaf) {
+    for (uint32_t h = from; h < to; h++) {
+        uint32_t blk, off;
+        dx_slot(dir, h, &blk, &off);
+        memcpy(txn_get(t, blk) + off, &leaf, sizeof(leaf));
+    }
+}
+
+/* The run [*lo, *hi) of buckets around h that share its leaf */
+static void dx_run(struct txn *t, const struct inode *dir, uint32_t h, uint32_t *lo,
+                   uint32_t *hi) {
+    uint32_t leaf = dx_get(t, dir, h), n = dx_nbuckets(t, dir);
+    for (*lo = h; *lo > 0 && dx_get(t, dir, *lo - 1) == leaf; (*lo)--) ;
+    for (*hi = h + 1; *hi < n && dx_get(t, dir, *hi) == leaf; (*hi)++) ;
+}
+
+static struct dx_leaf *dx_new_leaf(struct txn *t, int64_t *blk) {
+    *blk = txn_alloc_data(t);
+    if (*blk < 0) {
+        fprintf(stderr, "No free data block for a directory leaf\n");
+        return NULL;
+    }
+    struct dx_leaf *leaf = (struct dx_leaf *)txn_get(t, *blk);
+    memset(leaf, 0, BLOCK_SIZE);
+    leaf->magic = DX_LEAF_MAGIC;
+    return leaf;
+}
+
+/* Walks the chain for name's bucket. Returns the matching dirent or NULL; with
+ * room set, also reports the first leaf that has a free slot (0 if none). */
+static const struct dirent *dx_find(struct txn *t, const struct inode *dir, const char *name,
+                                    uint32_t *room) {
+    uint32_t leaf_blk = dx_get(t, dir, dx_bucket(t, dir, name));
+
+    if (room) *room = 0;
+    while (leaf_blk) {
+        const struct dx_leaf *leaf = (const struct dx_leaf *)txn_peek(t, leaf_blk);
+        if (leaf->magic != DX_LEAF_MAGIC) {
+            fprintf(stderr, "Corrupt directory leaf at block %u\n", leaf_blk);
+            bdev_error(&t->fs->dev, EIO);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < leaf->count; i++)
+            if (name_eq(&leaf->de[i], name))
+                return &leaf->de[i];
+        if (room && !*room && leaf->count < DX_LEAF_ENTRIES)
+            *room = leaf_blk;
+        leaf_blk = leaf->next;
+    }
+    return NULL;
+}
+
+/* Returns a free slot for a new entry. A full leaf serving several buckets
+ * moves the upper half of its run to a new leaf, so the index only changes
+ * on a split; one serving a single bucket gets a new leaf at the head of its
+ * chain. The first entry of an empty run of buckets claims the whole run. */
+static struct dirent *dx_add(struct txn *t, const struct inode *dir, const char *name) {
+    uint32_t room;
+    if (dx_find(t, dir, name, &room)) return NULL;
+
+    uint32_t nbuckets = dx_nbuckets(t, dir);
+    uint32_t h = name_hash(name) % nbuckets;
+    while (!room) {
+        uint32_t lo, hi, old = dx_get(t, dir, h);
+        int64_t blk;
+        dx_run(t, dir, h, &lo, &hi);
+        struct dx_leaf *leaf = dx_new_leaf(t, &blk);
+        if (!leaf) return NULL;
+
+        if (!old) {
+            dx_set(t, dir, lo, hi, blk);
+            room = blk;
+        } else if (hi - lo == 1) {
+            leaf->next = old;
+            dx_set(t, dir, h, h + 1, blk);
+            room = blk;
+        } else {
+            uint32_t mid = lo + (hi - lo) / 2;
+            struct dx_leaf *full = (struct dx_leaf *)txn_get(t, old);
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < full->count; i++) {
+                const struct dirent *de = &full->de[i];
+                if (name_hash(de->name) % nbuckets >= mid)
+                    leaf->de[leaf->count++] = *de;
+                else
+                    full->de[kept++] = *de;
+            }
+            memset(&full->de[kept], 0, (full->count - kept) * sizeof(struct dirent));
+            full->count = kept;
+            dx_set(t, dir, mid, hi, blk);
+            /* Every entry may have hashed to one half; split again if so */
+            uint32_t mine = h >= mid ? (uint32_t)blk : old;
+            const struct dx_leaf *target = (const struct dx_leaf *)txn_peek(t, mine);
+            if (target->count < DX_LEAF_ENTRIES) room = mine;
+        }
+    }
+
+    struct dx_leaf *leaf = (struct dx_leaf *)txn_get(t, room);
+    return &leaf->de[leaf->count++];
+}
+
+/* Unindexed directories: a packed array of dirents across the direct blocks.
+ * Without unlink the first free slot is always entry size / sizeof(dirent),
+ * and a new block is allocated when the previous one fills. */
+static const struct dirent *linear_find(struct txn *t, const struct inode *dir, const char *name) {
+    uint32_t entries = dir->size / sizeof(struct dirent);
+    for (uint32_t b = 0; b * DIRENTS_PER_BLOCK < entries; b++) {
+        const struct dirent *de = (const struct dirent *)txn_peek(t, dir->direct[b]);
+        uint32_t n = entries - b * DIRENTS_PER_BLOCK;
+        if (n > DIRENTS_PER_BLOCK) n = DIRENTS_PER_BLOCK;
+        for (uint32_t i = 0; i < n; i++)
+            if (name_eq(&de[i], name))
+                return &de[i];
+    }
+    return NULL;
+}
+
+static struct dirent *linear_add(struct txn *t, struct inode *dir, const char *name) {
+    uint32_t entries = dir->size / sizeof(struct dirent);
+    uint32_t b = entries / DIRENTS_PER_BLOCK;
+    if (b >= DIRECT_POINTERS) {
+        fprintf(stderr, "Directory full, cannot add '%s'\n", name);
+        return NULL;
+    }
+    if (!dir->direct[b]) {
+        int64_t blk = txn_alloc_data(t);
+        if (blk < 0) {
+            fprintf(stderr, "No free data block for a directory block\n");
+            return NULL;
+        }
+        memset(txn_get(t, blk), 0, BLOCK_SIZE);
+        dir->direct[b] = blk;
+    }
+    return (struct dirent *)txn_get(t, dir->direct[b]) + entries % DIRENTS_PER_BLOCK;
+}
+
+static const struct dirent *dir_find(struct txn *t, const struct inode *dir, const char *name) {
+    if (dir->flags & INODE_FLAG_HASHED)
+        return dx_find(t, dir, name, NULL);
+    return linear_find(t, dir, name);
+}
+
+/* Reserves the dirent for name in dir, which must be a writable image; NULL if
+ * the name exists or there is no room */
+static struct dirent *dir_add(struct txn *t, struct inode *dir, const char *name) {
+    if (dir_find(t, dir, name)) {
+        fprintf(stderr, "File '%s' already exists\n", name);
+        return NULL;
+    }
+    struct dirent *de = dir->flags & INODE_FLAG_HASHED ? dx_add(t, dir, name)
+                                                       : linear_add(t, dir, name);
+    if (!de) return NULL;
+
+    memset(de, 0, sizeof(*de));
+    strncpy(de->name, name, NAME_LEN - 1);
+    dir->size += sizeof(struct dirent);
+    dir->mtime = time(NULL);
+    return de;
+}
+
+static struct txn_block *txn_inode_block(struct txn *t, uint32_t ino) {
+    struct superblock *sb = &t->fs->sb;
+    struct txn_block *tb = txn_load(t, sb->inode_start + ino / INODES_PER_BLOCK, TXN_INODES);
+    tb->slots |= 1u << (ino % INODES_PER_BLOCK);
+    return tb;
+}
+
+static struct inode *txn_inode(struct txn *t, uint32_t ino) {
+    uint8_t *block = txn_write(txn_inode_block(t, ino));
+    return (struct inode *)(block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+}
+
+static const struct inode *txn_peek_inode(struct txn *t, uint32_t ino) {
+    const uint8_t *block = txn_view(txn_inode_block(t, ino));
+    return (const struct inode *)(block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+}
+
+/* Returns the new inode number, or -1 */
+static int64_t create_in_txn(struct txn *t, const char *filename) {
+    struct superblock *sb = &t->fs->sb;
+
+    /* The blocks a create always reads, fetched together */
+    uint32_t inode_hint = t->h->inode_hint < fs_inode_limit(sb) ? t->h->inode_hint : 0;
+    uint32_t data_hint = t->h->data_hint < fs_data_blocks(sb) ? t->h->data_hint : 0;
+    uint32_t want[] = {
+        sb->inode_start,
+        sb->inode_bitmap + inode_hint / BITS_PER_BLOCK,
+        sb->inode_start + inode_hint / INODES_PER_BLOCK,
+        sb->data_bitmap + data_hint / BITS_PER_BLOCK,
+    };
+    bcache_prefetch(&t->fs->cache, want, sizeof(want) / sizeof(want[0]));
+
+    struct inode *root = txn_inode(t, 0);
+    struct dirent *de = dir_add(t, root, filename);
+    if (!de) return -1;
+
+    int64_t new_ino = txn_alloc_bit(t, sb->inode_bitmap, fs_inode_limit(sb), &t->h->inode_hint);
+    if (new_ino < 0) {
+        fprintf(stderr, "No free inode for '%s'\n", filename);
+        return -1;
+    }
+    de->inode = new_ino;
+
+    struct inode *new_inode = txn_inode(t, new_ino);
+    memset(new_inode, 0, sizeof(*new_inode));
+    new_inode->type = INODE_TYPE_FILE;
+    new_inode->links = 1;
+    new_inode->size = 0;
+    new_inode->ctime = time(NULL);
+    new_inode->mtime = time(NULL);
+    new_inode->flags = INODE_FLAG_EXTENTS;
+    new_inode->eh = (struct extent_header){.magic = EXT_MAGIC, .max = INODE_EXTENTS};
+    return new_ino;
+}
+
+/* Extents */
+struct ext_leaf {
+    struct extent_header eh;
+    struct extent ext[];
+};
+
+/* The extent covering lblk, or NULL for a hole or past the end */
+static const struct extent *ext_find(struct txn *t, const struct inode *inode, uint32_t lblk) {
+    const struct extent_header *eh = &inode->eh;
+    const struct extent *ext = inode->ext;
+
+    if (eh->depth) {
+        uint32_t i = eh->entries;
+        while (i > 1 && ext[i - 1].lblk > lblk) i--;
+        const struct ext_leaf *leaf = (const struct ext_leaf *)txn_peek(t, ext[i - 1].pblk);
+        if (leaf->eh.magic != EXT_MAGIC) {
+            fprintf(stderr, "Corrupt extent leaf at block %u\n", ext[i - 1].pblk);
+            bdev_error(&t->fs->dev, EIO);
+            return NULL;
+        }
+        eh = &leaf->eh;
+        ext = leaf->ext;
+    }
+
+    /* Last extent starting at or before lblk */
+    uint32_t lo = 0, hi = eh->entries;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ext[mid].lblk <= lblk) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0 || lblk - ext[lo - 1].lblk >= ext[lo - 1].len) return NULL;
+    return &ext[lo - 1];
+}
+
+static struct ext_leaf *ext_new_leaf(struct txn *t, uint32_t *blk) {
+    int64_t b = txn_alloc_data(t);
+    if (b < 0) {
+        fprintf(stderr, "No free data block for an extent leaf\n");
+        return NULL;
+    }
+    struct ext_leaf *leaf = (struct ext_leaf *)txn_get(t, b);
+    memset(leaf, 0, BLOCK_SIZE);
+    leaf->eh = (struct extent_header){.magic = EXT_MAGIC, .max = LEAF_EXTENTS};
+    *blk = b;
+    return leaf;
+}
+
+/* Maps len blocks at lblk, which must follow the current last extent. A run
+ * that continues the last extent on disk just lengthens it. */
+static int ext_append(struct txn *t, struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+    struct extent_header *eh = &inode->eh;
+    struct extent *ext = inode->ext;
+    if (eh->depth) {
+        struct ext_leaf *leaf = (struct ext_leaf *)txn_get(t, ext[eh->entries - 1].pblk);
+        eh = &leaf->eh;
+        ext = leaf->ext;
+    }
+
+    struct extent *last = eh->entries ? &ext[eh->entries - 1] : NULL;
+    if (last && last->lblk + last->len == lblk && last->pblk + last->len == pblk &&
+        last->len <= UINT32_MAX - len) {
+        last->len += len;
+        return 0;
+    }
+
+    if (eh->entries == eh->max) {
+        uint32_t blk;
+        struct ext_leaf *leaf;
+        if (inode->eh.depth == 0) {
+            /* Push the inode's extents down into the first leaf */
+            if (!(leaf = ext_new_leaf(t, &blk))) return -1;
+            memcpy(leaf->ext, inode->ext, sizeof(inode->ext));
+            leaf->eh.entries = inode->eh.entries;
+            memset(inode->ext, 0, sizeof(inode->ext));
+            inode->ext[0] = (struct extent){.lblk = 0, .pblk = blk};
+            inode->eh.entries = 1;
+            inode->eh.depth = 1;
+        } else if (inode->eh.entries < inode->eh.max) {
+            if (!(leaf = ext_new_leaf(t, &blk))) return -1;
+            inode->ext[inode->eh.entries++] = (struct extent){.lblk = lblk, .pblk = blk};
+        } else {
+            fprintf(stderr, "File needs more than %zu extents\n",
+                    (size_t)INODE_EXTENTS * LEAF_EXTENTS);
+            return -1;
+        }
+        eh = &leaf->eh;
+        ext = leaf->ext;
+    }
+    ext[eh->entries++] = (struct extent){.lblk = lblk, .pblk = pblk, .len = len};
+    return 0;
+}
+
+/* Write and read commands move data in runs of up to this many blocks */
+#define IO_CHUNK_BLOCKS 256
+
+/* An append in progress. Its new runs are written before the transaction
+ * that maps them commits, into blocks the handle keeps claimed, so after a
+ * conflict the transaction is rebuilt around the same runs without
+ * rereading the source. */
+struct write_run {
+    uint32_t lblk, pblk, len;
+};
+
+struct write_state {
+    int rebuild;
+    uint64_t start, size;
+    uint8_t head[BLOCK_SIZE];   /* completes the old partial last block */
+    size_t head_len;
+    struct write_run *runs;
+    uint32_t nruns, cap;
+};
+
+static void write_add_run(struct write_state *w, uint32_t lblk, uint32_t pblk, uint32_t len) {
+    if (w->nruns == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->runs = realloc(w->runs, w->cap * sizeof(*w->runs));
+        if (!w->runs) die("realloc");
+    }
+    w->runs[w->nruns++] = (struct write_run){.lblk = lblk, .pblk = pblk, .len = len};
+}
+
+/* Builds the append in t, reading src and writing the new runs the first time */
+static int write_build(struct txn *t, const char *filename, FILE *src, struct write_state *w,
+                       uint8_t *buf) {
+    struct fs *fs = t->fs;
+    const struct dirent *de = dir_find(t, txn_peek_inode(t, 0), filename);
+    int64_t ino = de ? de->inode : create_in_txn(t, filename);
+    if (ino < 0) return -1;
+    struct inode *inode = txn_inode(t, ino);
+    if (inode->type != INODE_TYPE_FILE || !(inode->flags & INODE_FLAG_EXTENTS)) {
+        fprintf(stderr, "'%s' is not an extent-mapped regular file\n", filename);
+        return -1;
+    }
+    if (!w->rebuild) {
+        w->start = inode->size;
+    } else if (inode->size != w->start) {
+        fprintf(stderr, "'%s' changed while it was written\n", filename);
+        return -1;
+    }
+
+    uint64_t size = w->start;
+    if (size % BLOCK_SIZE) {
+        uint32_t off = size % BLOCK_SIZE;
+        if (!w->rebuild) w->head_len = fread(w->head, 1, BLOCK_SIZE - off, src);
+        const struct extent *e = ext_find(t, inode, size / BLOCK_SIZE);
+        if (!e) {
+            fprintf(stderr, "Corrupt extent map for '%s'\n", filename);
+            return -1;
+        }
+        memcpy(txn_get(t, e->pblk + (size / BLOCK_SIZE - e->lblk)) + off, w->head, w->head_len);
+        size += w->head_len;
+    }
+
+    if (w->rebuild) {
+        for (uint32_t i = 0; i < w->nruns; i++) {
+            const struct write_run *r = &w->runs[i];
+            txn_mark_data(t, r->pblk, r->len);
+            if (ext_append(t, inode, r->lblk, r->pblk, r->len) < 0) return -1;
+        }
+        inode->size = w->size;
+        inode->mtime = time(NULL);
+        return 0;
+    }
+
+    uint32_t lblk = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t n;
+    while ((n = fread(buf, 1, (size_t)IO_CHUNK_BLOCKS * BLOCK_SIZE, src)) > 0) {
+        if (size + n > UINT32_MAX) {
+            fprintf(stderr, "File '%s' would exceed 4 GiB\n", filename);
+            return -1;
+        }
+        uint32_t blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset(buf + n, 0, (size_t)blocks * BLOCK_SIZE - n);
+
+        for (uint32_t done = 0; done < blocks; ) {
+            /* Aim right after the last extent so the file stays contiguous */
+            const struct extent *last = lblk ? ext_find(t, inode, lblk - 1) : NULL;
+            if (last) t->h->data_hint = last->pblk + last->len - fs->sb.data_start;
+
+            uint32_t got;
+            int64_t pblk = txn_alloc_data_run(t, blocks - done, &got);
+            if (pblk < 0) {
+                fprintf(stderr, "No free data blocks for '%s'\n", filename);
+                return -1;
+            }
+            bdev_pwrite(&fs->dev, (off_t)pblk * BLOCK_SIZE, buf + (size_t)done * BLOCK_SIZE,
+                        (size_t)got * BLOCK_SIZE);
+            write_add_run(w, lblk, pblk, got);
+            if (ext_append(t, inode, lblk, pblk, got) < 0) return -1;
+            done += got;
+            lblk += got;
+        }
+        size += n;
+    }
+    if (ferror(src)) {
+        perror("read");
+        return -1;
+    }
+    if (w->nruns) bdev_flush(&fs->dev);
+
+    w->size = size;
+    inode->size = size;
+    inode->mtime = time(NULL);
+    return 0;
+}
+
+/* Appends src to filename, creating it if needed. New data goes straight to
+ * freshly allocated runs, flushed before the transaction that maps them
+ * commits; only a partial last block is updated through the journal. Like
+ * a create, the transaction is built outside the fs lock and rebuilt when a
+ * concurrent commit invalidates it. */
+int64_t fs_write(struct fs *fs, const char *filename, FILE *src, uint64_t *new_size) {
+    if (fs_failed(fs)) return -1;
+    struct fs_handle *h = &fs->handle;
+    struct write_state *w = calloc(1, sizeof(*w));
+    uint8_t *buf = malloc((size_t)IO_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!w || !buf) die("malloc");
+    int64_t rc = -1;
+
+    for (;;) {
+        struct txn t;
+        txn_begin(&t, h);
+        if (write_build(&t, filename, src, w, buf) == 0) {
+            fs_lock(fs);
+            init_journal_if_needed(fs);
+            int err = txn_commit(&t);
+            if (err == TXN_CONFLICT) {
+                txn_end(&t);
+                h->retries++;
+                w->rebuild = 1;
+                continue;
+            }
+            if (err == 0) {
+                rc = w->size - w->start;
+                if (new_size) *new_size = w->size;
+            }
+        }
+        txn_end(&t);
+        break;
+    }
+    claims_release(h);
+    free(w->runs);
+    free(w);
+    free(buf);
+    return rc;
+}
+
+/* Copies filename to out, one read per extent run; blocks the cache holds
+ * (journaled but not yet checkpointed) override what is on disk */
+int fs_read(struct fs *fs, const char *filename, FILE *out) {
+    if (fs_failed(fs)) return -1;
+    struct txn t;
+    txn_begin(&t, &fs->handle);
+    int rc = -1;
+    uint8_t *buf = malloc((size_t)IO_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!buf) die("malloc");
+
+    const struct dirent *de = dir_find(&t, txn_peek_inode(&t, 0), filename);
+    if (!de) {
+        fprintf(stderr, "%s: not found\n", filename);
+        goto out;
+    }
+    struct inode inode = *txn_peek_inode(&t, de->inode);
+    if (inode.type != INODE_TYPE_FILE || !(inode.flags & INODE_FLAG_EXTENTS)) {
+        fprintf(stderr, "'%s' is not an extent-mapped regular file\n", filename);
+        goto out;
+    }
+
+    uint32_t nblocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t lblk = 0; lblk < nblocks; ) {
+        const struct extent *e = ext_find(&t, &inode, lblk);
+        uint32_t n = nblocks - lblk;
+        if (n > IO_CHUNK_BLOCKS) n = IO_CHUNK_BLOCKS;
+        if (!e) {
+            memset(buf, 0, (size_t)n * BLOCK_SIZE);   /* hole */
+        } else {
+            if (n > e->lblk + e->len - lblk) n = e->lblk + e->len - lblk;
+            uint32_t pblk = e->pblk + (lblk - e->lblk);
+            bdev_pread(&fs->dev, (off_t)pblk * BLOCK_SIZE, buf, (size_t)n * BLOCK_SIZE);
+            if (bdev_failed(&fs->dev)) goto out;
+            for (uint32_t i = 0; i < n; i++)
+                bcache_read_cached(&fs->cache, pblk + i, buf + (size_t)i * BLOCK_SIZE);
+        }
+        size_t len = (size_t)n * BLOCK_SIZE;
+        if (lblk + n == nblocks && inode.size % BLOCK_SIZE)
+            len -= BLOCK_SIZE - inode.size % BLOCK_SIZE;
+        if (fwrite(buf, 1, len, out) != len) {
+            perror("write");
+            goto out;
+        }
+        lblk += n;
+    }
+    rc = 0;
+out:
+    free(buf);
+    txn_end(&t);
+    return rc;
+}
+
+/* Spreads handles' starting points over this many regions of each bitmap */
+#define HANDLE_REGIONS 16
+
+struct fs_handle *fs_handle_open(struct fs *fs) {
+    struct fs_handle *h = calloc(1, sizeof(*h));
+    if (!h) die("calloc");
+    h->fs = fs;
+
+    /* fs->handle starts region 0. Inode hints are block-aligned so handles
+     * share no inode-table block until a region fills up. */
+    uint32_t k = __atomic_add_fetch(&fs->nhandles, 1, __ATOMIC_RELAXED) % HANDLE_REGIONS;
+    h->inode_hint = (uint64_t)fs_inode_limit(&fs->sb) * k / HANDLE_REGIONS /
+                    INODES_PER_BLOCK * INODES_PER_BLOCK;
+    h->data_hint = (uint64_t)fs_data_blocks(&fs->sb) * k / HANDLE_REGIONS;
+    return h;
+}
+
+void fs_handle_close(struct fs_handle *h) {
+    __atomic_add_fetch(&h->fs->retries, h->retries, __ATOMIC_RELAXED);
+    free(h->claims);
+    free(h);
+}
+
+/* Creates every file in one transaction, so shared blocks are logged once.
+ * The transaction is built outside the fs lock and rebuilt from scratch
+ * when a concurrent commit invalidates it. */
+int64_t fs_handle_create(struct fs_handle *h, const char *const *filenames, int n) {
+    struct fs *fs = h->fs;
+    if (fs_failed(fs)) return -1;
+    for (;;) {
+        struct txn t;
+        txn_begin(&t, h);
+        int64_t ino = -1;
+        for (int i = 0; i < n; i++)
+            if ((ino = create_in_txn(&t, filenames[i])) < 0)
+                break;
+        if (ino >= 0) {
+            fs_lock(fs);
+            init_journal_if_needed(fs);
+            int rc = txn_commit(&t);
+            if (rc == TXN_CONFLICT) {
+                txn_end(&t);
+                claims_release(h);
+                h->retries++;
+                continue;
+            }
+            if (rc < 0) ino = -1;
+        }
+        txn_end(&t);
+        claims_release(h);
+        return ino;
+    }
+}
+
+int64_t fs_create(struct fs *fs, const char *const *filenames, int n) {
+    return fs_handle_create(&fs->handle, filenames, n);
+}
+
+int64_t fs_lookup(struct fs *fs, const char *name) {
+    if (fs_failed(fs)) return -1;
+    struct txn t;
+    txn_begin(&t, &fs->handle);
+    const struct dirent *de = dir_find(&t, txn_peek_inode(&t, 0), name);
+    int64_t ino = de && !bdev_failed(&fs->dev) ? (int64_t)de->inode : -1;
+    txn_end(&t);
+    return ino;
+}
+
+/* Install */
+int64_t fs_install(struct fs *fs, uint32_t max_txns) {
+    if (fs_failed(fs)) return -1;
+    struct journal_header jh;
+    bdev_pread(&fs->dev, journal_off(fs, 0), &jh, sizeof(jh));
+    if (bdev_failed(&fs->dev)) return -1;
+    if (jh.magic != JOURNAL_MAGIC) {
+        fprintf(stderr, "Journal not initialized or corrupted\n");
+        return -1;
+    }
+    uint32_t n = journal_checkpoint(fs, max_txns);
+    return bdev_failed(&fs->dev) ? -1 : (int64_t)n;
+}
+
+int fs_sync(struct fs *fs) {
+    fs_lock(fs);
+    journal_group_flush(fs);
+    fs_unlock(fs);
+    return bdev_failed(&fs->dev) ? -1 : 0;
+}
+
+void fs_stat(struct fs *fs, struct fs_stat *st) {
+    fs_lock(fs);
+    *st = (struct fs_stat){
+        .commits = fs->j.commits,
+        .pending = fs->j.ntxn,
+        .installed_tid = fs->j.installed_tid,
+        .next_tid = fs->j.next_tid,
+        .journal_used = fs->j.tail - fs->j.head,
+        .journal_size = fs->j.capacity,
+        .cache_hits = fs->cache.hits,
+        .cache_misses = fs->cache.misses,
+    };
+    fs_unlock(fs);
+}
+
+/* Mkfs */
+int64_t fs_mkfs(const char *path, uint32_t journal_blocks, uint32_t inodes, uint32_t data_blocks,
+                uint32_t index_blocks) {
+    if (journal_blocks < 2 || inodes < 1 || data_blocks < 1) {
+        fprintf(stderr, "mkfs needs at least 2 journal blocks, 1 inode and 1 data block\n");
+        return -1;
+    }
+    if (journal_blocks > JOURNAL_BLOCKS_MAX) {
+        fprintf(stderr, "Journal can be at most %u blocks\n", JOURNAL_BLOCKS_MAX);
+        return -1;
+    }
+    if (index_blocks > DIRECT_POINTERS || data_blocks < index_blocks) {
+        fprintf(stderr, "Directory index must be at most %d blocks and fit in the data blocks\n",
+                DIRECT_POINTERS);
+        return -1;
+    }
+    uint32_t root_blocks = index_blocks ? index_blocks : 1;
+
+    uint64_t inode_bmap_blocks = ((uint64_t)inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t data_bmap_blocks = ((uint64_t)data_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t inode_table_blocks = ((uint64_t)inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    uint64_t total = 1 + (uint64_t)journal_blocks + inode_bmap_blocks + data_bmap_blocks +
+                     inode_table_blocks + data_blocks;
+    if (total > UINT32_MAX) {
+        fprintf(stderr, "Filesystem of %llu blocks is too large\n", (unsigned long long)total);
+        return -1;
+    }
+
+    struct superblock sb = {
+        .magic = FS_MAGIC,
+        .block_size = BLOCK_SIZE,
+        .total_blocks = total,
+        .inode_count = inodes,
+        .journal_block = 1,
+    };
+    sb.inode_bitmap = sb.journal_block + journal_blocks;
+    sb.data_bitmap = sb.inode_bitmap + inode_bmap_blocks;
+    sb.inode_start = sb.data_bitmap + data_bmap_blocks;
+    sb.data_start = sb.inode_start + inode_table_blocks;
+
+    /* Everything not written below reads back as zeroes from the sparse file */
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    int err = ftruncate(fd, (off_t)total * BLOCK_SIZE) < 0 ? errno : 0;
+    if (close(fd) < 0 && !err) err = errno;
+    if (err) {
+        fprintf(stderr, "%s: %s\n", path, strerror(err));
+        return -1;
+    }
+
+    struct blkdev dev;
+    if (bdev_open(&dev, path, 0, 0) < 0) return -1;
+    uint8_t *block = calloc(1, BLOCK_SIZE);
+    if (!block) die("calloc");
+
+    memcpy(block, &sb, sizeof(sb));
+    bdev_write(&dev, 0, block);
+
+    struct journal_header jh = {.magic = JOURNAL_MAGIC};
+    bdev_pwrite(&dev, (off_t)sb.journal_block * BLOCK_SIZE, &jh, sizeof(jh));
+
+    /* Inode 0 is the root directory, owning the first data blocks */
+    memset(block, 0, BLOCK_SIZE);
+    bitmap_set(block, 0);
+    bdev_write(&dev, sb.inode_bitmap, block);
+    for (uint32_t i = 1; i < root_blocks; i++)
+        bitmap_set(block, i);
+    bdev_write(&dev, sb.data_bitmap, block);
+
+    memset(block, 0, BLOCK_SIZE);
+    struct inode *root = (struct inode *)block;
+    root->type = INODE_TYPE_DIR;
+    root->links = 2;
+    for (uint32_t i = 0; i < root_blocks; i++)
+        root->direct[i] = sb.data_start + i;
+    root->ctime = root->mtime = time(NULL);
+    if (index_blocks) root->flags = INODE_FLAG_HASHED;
+    bdev_write(&dev, sb.inode_start, block);
+
+    if (index_blocks) {
+        memset(block, 0, BLOCK_SIZE);
+        struct dx_root *dx = (struct dx_root *)block;
+        dx->magic = DX_MAGIC;
+        dx->index_blocks = index_blocks;
+        bdev_write(&dev, sb.data_start, block);
+    }
+
+    bdev_flush(&dev);
+    free(block);
+    return bdev_close(&dev) < 0 ? -1 : (int64_t)sb.total_blocks;
+}
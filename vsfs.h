@@ -0,0 +1,106 @@
+#ifndef VSFS_H
+#define VSFS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* libvsfs: a mounted image behind a handle. The superblock, the block cache
+ * (bitmaps, inode and directory blocks) and the journal state stay in memory
+ * from fs_open() to fs_close(), so a process issuing many operations reads
+ * its metadata once. Build it with the tool or on its own:
+ *
+ *   cc -O2 -pthread -c vsfs.c && ar rcs libvsfs.a vsfs.o
+ *
+ * The io_uring backend is opt-in: compile with -DHAVE_LIBURING and link
+ * with -luring. Failed operations report the reason on stderr and return
+ * -1, or NULL. After an I/O error or corrupt metadata nothing more is
+ * written to the image and every later call on the mount fails; only
+ * running out of memory ends the process.
+ *
+ * Every call may be made from any thread, except that a handle (the mount's
+ * own, used by fs_create(), or one from fs_handle_open()) serves one thread
+ * at a time. Creates through different handles build their transactions in
+ * parallel and only serialize to commit them. */
+
+#define FS_CACHE_BLOCKS_DEFAULT 64
+#define FS_INSTALL_THREADS 4
+#define FS_NAME_MAX 27   /* longer names are cut to this many bytes */
+
+struct fs_opts {
+    uint32_t cache_blocks;
+    int stats;                  /* print cache and journal statistics on fs_close() */
+    int use_mmap;
+    int use_uring;
+    int direct;                 /* O_DIRECT journal writes */
+    uint32_t group_max;         /* durable mode: transactions per group commit, 0 = off */
+    uint32_t group_latency_ms;  /* durable mode: flush a group once its oldest is this old */
+    uint32_t install_threads;   /* checkpoint writers */
+    uint32_t checkpoint_at;     /* checkpoint in the background past this % of the log, 0 = off */
+};
+
+#define FS_OPTS_DEFAULT {.cache_blocks = FS_CACHE_BLOCKS_DEFAULT, \
+                         .install_threads = FS_INSTALL_THREADS}
+
+struct fs_stat {
+    uint64_t commits;           /* through every handle since fs_open() */
+    uint32_t pending;           /* committed transactions not yet installed */
+    uint64_t installed_tid;
+    uint64_t next_tid;
+    uint64_t journal_used;      /* bytes */
+    uint32_t journal_size;
+    uint64_t cache_hits, cache_misses;
+};
+
+struct fs;
+struct fs_handle;
+
+/* Writes an empty filesystem to path; index_blocks of 0 gives the root a
+ * single unindexed block. Returns its size in blocks. */
+int64_t fs_mkfs(const char *path, uint32_t journal_blocks, uint32_t inodes, uint32_t data_blocks,
+                uint32_t index_blocks);
+
+/* Mounts path, replaying committed transactions into the cache; NULL if it
+ * cannot be opened or is not a usable image */
+struct fs *fs_open(const char *path, const struct fs_opts *opts);
+
+/* Writes out a staged group commit, stops the checkpointer and unmounts.
+ * Nothing else is synced: without group commit or use_mmap, commits are
+ * only as durable as the page cache. Returns -1 if any I/O on the image
+ * failed while it was mounted. */
+int fs_close(struct fs *fs);
+
+/* Starts the background checkpointer when opts->checkpoint_at is set */
+void fs_start_checkpointer(struct fs *fs);
+
+/* Creates n files in the root directory as one transaction. Returns the
+ * inode of the last one. */
+int64_t fs_create(struct fs *fs, const char *const *names, int n);
+
+/* A handle for one more creating thread; close them all before fs_close() */
+struct fs_handle *fs_handle_open(struct fs *fs);
+void fs_handle_close(struct fs_handle *h);
+
+/* fs_create() through h */
+int64_t fs_handle_create(struct fs_handle *h, const char *const *names, int n);
+
+/* Inode of name in the root directory, or -1 when it does not exist */
+int64_t fs_lookup(struct fs *fs, const char *name);
+
+/* Appends src to name, creating it if needed. Returns the bytes appended and
+ * sets *size, if given, to the new file size. */
+int64_t fs_write(struct fs *fs, const char *name, FILE *src, uint64_t *size);
+
+/* Copies name to out */
+int fs_read(struct fs *fs, const char *name, FILE *out);
+
+/* Checkpoints the oldest max_txns committed transactions (UINT32_MAX for
+ * all) to their home locations. Returns how many were installed. */
+int64_t fs_install(struct fs *fs, uint32_t max_txns);
+
+/* With group commit, flushes the transactions still staged in memory.
+ * Returns -1 if the image has failed. */
+int fs_sync(struct fs *fs);
+
+void fs_stat(struct fs *fs, struct fs_stat *st);
+
+#endif